@@ -5,3 +5,11 @@ set_target_properties(simaai-memory-lib::simaaimem PROPERTIES
     INTERFACE_INCLUDE_DIRECTORIES "/usr/include"
 )
 
+
+add_library(simaai-memory-lib::simaaimem_static STATIC IMPORTED)
+
+set_target_properties(simaai-memory-lib::simaaimem_static PROPERTIES
+    IMPORTED_LOCATION "/usr/lib/aarch64-linux-gnu/libsimaaimem.a"
+    INTERFACE_INCLUDE_DIRECTORIES "/usr/include"
+    INTERFACE_LINK_LIBRARIES "pthread"
+)
@@ -22,6 +22,7 @@
 #include "simaai_memory.h"
 
 #define NUM_THREADS 100
+#define STRIDED_BUF_SIZE (64 * 1024)
 
 struct args {
 	char chr;
@@ -33,6 +34,7 @@ struct args {
 	long int NumIteration;
 	unsigned int flags;
 	char use_segments;
+	char strided;
 };
 
 static int parse_args(const int argc, char *const argv[], struct args *args)
@@ -50,6 +52,7 @@ static int parse_args(const int argc, char *const argv[], struct args *args)
 		{ "mcpDst", required_argument, NULL, 'y' },
 		{ "pthreadNum", required_argument, NULL, 'p' },
 		{ "iteration",  required_argument, NULL, 'i' },
+		{ "strided", no_argument,      NULL, 'm' },
 		{ 0,        0,                 0,     0  }
 	};
 	const char usage[] =
@@ -66,14 +69,15 @@ static int parse_args(const int argc, char *const argv[], struct args *args)
 		"  -x, --mcpSrc        memcpy source target[0-6]\n"
 		"  -y, --mcpDst        memcpy destination target[0-6]\n"
 		"  -p, --pthreadNum    number of pthreads to execute in parallel for memcpy \n"
-		"  -i, --iteration     number of memcpy iterations in each thread \n";
+		"  -i, --iteration     number of memcpy iterations in each thread \n"
+		"  -m, --strided       copy strided 2D and 3D regions between mcpSrc and mcpDst (or target)\n";
 	int option_index;
 	int c;
 	args->use_segments = 0;
 
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "hv:s:t:x:y:p:i:crf", long_options, &option_index);
+		c = getopt_long(argc, argv, "hv:s:t:x:y:p:i:crfm", long_options, &option_index);
 
 		if (c == -1)
 			break;
@@ -140,6 +144,9 @@ static int parse_args(const int argc, char *const argv[], struct args *args)
 		case 'r':
 			args->flags |= SIMAAI_MEM_FLAG_RDONLY;
 			break;
+		case 'm':
+			args->strided = 1;
+			break;
 		default:
 			fprintf(stderr, usage, basename(filename));
 			return -1;
@@ -268,11 +275,14 @@ static void verify_memcpy_wrapper(simaai_memory_t *mem_dst, simaai_memory_t *mem
 	random_num = rand() % 26;
 	random_char = 'a' + random_num;
 	memset(vaddr_in, random_char, simaai_memory_get_size(mem_src));
-	if(args->flags & SIMAAI_MEM_FLAG_CACHED)
-		simaai_memory_flush_cache(mem_src);
 
+	size = simaai_memory_get_size(mem_src);
+	if (size > simaai_memory_get_size(mem_dst))
+		size = simaai_memory_get_size(mem_dst);
+
+	/* Cleans the source and invalidates the destination over the copy */
 	clock_gettime(CLOCK_MONOTONIC, &start);
-	cp_buf = simaai_memcpy(mem_dst, mem_src);
+	cp_buf = simaai_memcpy_coherent(mem_dst, 0, mem_src, 0, size);
 	clock_gettime(CLOCK_MONOTONIC, &end);
 	if (!cp_buf) {
 		fprintf(stderr, "simaai_memcpy failed: %s\n",
@@ -283,9 +293,6 @@ static void verify_memcpy_wrapper(simaai_memory_t *mem_dst, simaai_memory_t *mem
                    (end.tv_nsec - start.tv_nsec) / 1e9;
 	fprintf(stdout, "memcpy elapsetime for %lld bytes:%.9f sec\n",args->size, elapsed_time);
 
-	if(args->flags & SIMAAI_MEM_FLAG_CACHED)
-		simaai_memory_invalidate_cache(mem_dst);
-
 	if (memcmp(vaddr_out, vaddr_in, size) == 0) {
 		fprintf(stdout,"memory copy through simaai_memcpy is passed.\n");
 	} else {
@@ -304,13 +311,15 @@ static void test_memcpy_wrapper(const struct args *args)
 	simaai_memory_t *mem_src;
 	simaai_memory_t *mem_dst;
 
-	mem_src = simaai_memory_alloc(args->size, args->mcpSrc_target);
+	mem_src = simaai_memory_alloc_flags(args->size, args->mcpSrc_target,
+					   args->flags & SIMAAI_MEM_FLAG_CACHED);
 	if (!mem_src) {
 		fprintf(stderr, "src memory allocation failed: %s\n",
 				strerror(errno));
 		goto end;
 	}
-	mem_dst = simaai_memory_alloc(args->size, args->mcpDst_target);
+	mem_dst = simaai_memory_alloc_flags(args->size, args->mcpDst_target,
+					   args->flags & SIMAAI_MEM_FLAG_CACHED);
 	if (!mem_dst) {
 		fprintf(stderr, "dst  memory allocation failed: %s\n",
 				strerror(errno));
@@ -352,6 +361,120 @@ static void test_multithread_memcpy_wrapper(const struct args *args)
 
 }
 
+/* Strided region: shape[2] contiguous bytes, shape[0] x shape[1] times */
+struct strided_case {
+	const char *name;
+	unsigned int ndim;
+	uint64_t shape[3];
+	uint64_t src_strides[2];
+	uint64_t dst_strides[2];
+	uint64_t src_offset;
+	uint64_t dst_offset;
+};
+
+static const struct strided_case strided_cases[] = {
+	{ "2D rows",       2, { 1, 37, 100 }, { 0, 160 },     { 0, 128 },    3, 5 },
+	{ "3D tile",       3, { 4, 9, 24 },   { 592, 64 },    { 288, 32 },   0, 7 },
+	{ "3D contiguous", 3, { 3, 8, 64 },   { 512, 64 },    { 512, 64 },   64, 64 },
+	{ "3D transpose",  3, { 5, 6, 16 },   { 16, 80 },     { 96, 16 },    11, 0 },
+};
+
+static int verify_strided_case(simaai_memory_t *mem_dst, simaai_memory_t *mem_src,
+		const struct strided_case *test, unsigned char *ref, int cached)
+{
+	unsigned char *vaddr_out = simaai_memory_get_virt(mem_dst);
+	unsigned char *vaddr_in = simaai_memory_get_virt(mem_src);
+	simaai_memory_t *cp_buf;
+	uint64_t i, j;
+
+	memset(vaddr_out, 0, simaai_memory_get_size(mem_dst));
+	memset(ref, 0, simaai_memory_get_size(mem_dst));
+	if (cached)
+		simaai_memory_flush_cache(mem_dst);
+
+	for (i = 0; i < test->shape[0]; i++)
+		for (j = 0; j < test->shape[1]; j++)
+			memcpy(ref + test->dst_offset + i * test->dst_strides[0] + j * test->dst_strides[1],
+			       vaddr_in + test->src_offset + i * test->src_strides[0] + j * test->src_strides[1],
+			       test->shape[2]);
+
+	if (test->ndim == 2)
+		cp_buf = simaai_memcpy_2d(mem_dst, test->dst_offset, test->dst_strides[1],
+					  mem_src, test->src_offset, test->src_strides[1],
+					  test->shape[2], test->shape[1]);
+	else
+		cp_buf = simaai_memcpy_nd(mem_dst, test->dst_offset, test->dst_strides,
+					  mem_src, test->src_offset, test->src_strides,
+					  test->shape, test->ndim);
+	if (!cp_buf) {
+		fprintf(stderr, "%s copy failed: %s\n", test->name, strerror(errno));
+		return -1;
+	}
+
+	if (cached)
+		simaai_memory_invalidate_cache(mem_dst);
+
+	/* Bytes between the rows must be left untouched */
+	if (memcmp(vaddr_out, ref, simaai_memory_get_size(mem_dst)) != 0) {
+		fprintf(stdout, "%s copy has mismatches.\n", test->name);
+		return -1;
+	}
+
+	fprintf(stdout, "%s copy is passed.\n", test->name);
+	return 0;
+}
+
+static void test_strided_memcpy_wrapper(const struct args *args)
+{
+	simaai_memory_t *mem_src = NULL;
+	simaai_memory_t *mem_dst = NULL;
+	unsigned char *vaddr_in, *ref = NULL;
+	int src_target = (args->mcpSrc_target != -1) ? args->mcpSrc_target : args->target;
+	int dst_target = (args->mcpDst_target != -1) ? args->mcpDst_target : args->target;
+	unsigned int iter, failed = 0;
+
+	mem_src = simaai_memory_alloc_flags(STRIDED_BUF_SIZE, src_target,
+					   args->flags & SIMAAI_MEM_FLAG_CACHED);
+	mem_dst = simaai_memory_alloc_flags(STRIDED_BUF_SIZE, dst_target,
+					   args->flags & SIMAAI_MEM_FLAG_CACHED);
+	if (!mem_src || !mem_dst) {
+		fprintf(stderr, "Strided copy memory allocation failed: %s\n",
+				strerror(errno));
+		goto end;
+	}
+
+	vaddr_in = simaai_memory_map(mem_src);
+	if (!vaddr_in || !simaai_memory_map(mem_dst)) {
+		fprintf(stderr, "Strided copy memory mapping failed: %s\n",
+				strerror(errno));
+		goto end;
+	}
+
+	ref = malloc(simaai_memory_get_size(mem_dst));
+	if (!ref)
+		goto end;
+
+	for (iter = 0; iter < simaai_memory_get_size(mem_src); iter++)
+		vaddr_in[iter] = (iter * 31 + 7) & 0xff;
+	if (args->flags & SIMAAI_MEM_FLAG_CACHED)
+		simaai_memory_flush_cache(mem_src);
+
+	for (iter = 0; iter < sizeof(strided_cases) / sizeof(strided_cases[0]); iter++)
+		if (verify_strided_case(mem_dst, mem_src, &strided_cases[iter], ref,
+					args->flags & SIMAAI_MEM_FLAG_CACHED) < 0)
+			failed++;
+
+	fprintf(stdout, "strided copies: %u of %zu passed\n",
+		(unsigned int)(sizeof(strided_cases) / sizeof(strided_cases[0])) - failed,
+		sizeof(strided_cases) / sizeof(strided_cases[0]));
+end:
+	free(ref);
+	if (mem_src)
+		simaai_memory_free(mem_src);
+	if (mem_dst)
+		simaai_memory_free(mem_dst);
+}
+
 static void test_memory_wrapper(const struct args *args)
 {
 	simaai_memory_t **segments_arr = NULL;
@@ -407,7 +530,9 @@ int main(int argc, char *argv[])
 	if (parse_args(argc, argv, &args) != 0)
 		return EXIT_FAILURE;
 
-	if((args.mcpSrc_target != -1) && (args.mcpDst_target != -1))
+	if (args.strided)
+		test_strided_memcpy_wrapper(&args);
+	else if((args.mcpSrc_target != -1) && (args.mcpDst_target != -1))
 		test_multithread_memcpy_wrapper(&args);
 	else
 		test_memory_wrapper(&args);
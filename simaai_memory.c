@@ -3,25 +3,47 @@
  * Copyright (c) 2021 Sima ai
  */
 
+#define _GNU_SOURCE
+
 #include "simaai_memory.h"
+#ifdef SIMAAI_MEM_EMULATION
+#include "simaai_memory_emu.h"
+#endif
+#include "simaai_memory_inline.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <linux/simaai/simaai_memory_ioctl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #define SIMAAI_ALLOCATOR	"/dev/simaai-mem"
 #define SIMAAI_CACHE_LINE_SIZE	(64)
+#define SIMAAI_MEM_NUM_TARGETS	(SIMAAI_MEM_TARGET_DMS3 + 1)
+#define SIMAAI_MEMINFO		"/proc/meminfo"
+#define SIMAAI_PAGE_SIZE	(4096)
+/* Set in refs when a chunk is freed while slices still use it */
+#define SIMAAI_MEM_REFS_RELEASED	(1u << 31)
+/* Flags handled by the library and never passed to the driver */
+#define SIMAAI_MEM_LIBRARY_FLAGS	(SIMAAI_MEM_FLAG_ZERO | SIMAAI_MEM_FLAG_SHARED_MAP)
 
 struct simaai_memory_t {
         /* Virtual address of memory chunk */
         void *vaddr;
         /* Size of memory chunk */
-        unsigned int size;
+        uint64_t size;
         /* Physical address of the memory chunk */
         uint64_t phys_addr;
         /* Bus address of the memory chunk */
@@ -30,22 +52,239 @@ struct simaai_memory_t {
         uint64_t target;
         /* indicates offset from parent segment */
         uint64_t offset;
+        /* Allocation flags */
+        int flags;
+        /* How the chunk was obtained, SIMAAI_MEM_KIND_* */
+        int kind;
+        /* Live allocations registry links */
+        struct simaai_memory_t *reg_prev;
+        struct simaai_memory_t *reg_next;
+        /* Preallocation pool the chunk is reserved in */
+        struct simaai_memory_pool *pool;
+        /* Mapping kept by the pool while the chunk is not mapped by the user */
+        void *pool_vaddr;
+        /* Size class of a pool chunk, size is the requested size while in use */
+        uint64_t pool_size;
+        /* Next idle chunk of the pool */
+        struct simaai_memory_t *pool_next;
+        /* Next chunk waiting for a deferred free */
+        struct simaai_memory_t *defer_next;
+        /* Chunk this one is carved from, its memory is owned by the parent */
+        struct simaai_memory_t *parent;
+        /* Live slices of this chunk, SIMAAI_MEM_REFS_RELEASED once freed */
+        uint32_t refs;
+        /* Segment group sharing one mapping, SIMAAI_MEM_FLAG_SHARED_MAP */
+        struct simaai_memory_group *group;
 };
 
+/* The head of the context is read directly by simaai_memory_inline.h */
+#define SIMAAI_MEM_HEAD_MEMBER(member) \
+	_Static_assert(offsetof(struct simaai_memory_t, member) == \
+		       offsetof(struct simaai_memory_head, member) && \
+		       sizeof(((struct simaai_memory_t *)0)->member) == \
+		       sizeof(((struct simaai_memory_head *)0)->member), \
+		       "simaai_memory_t head layout changed, bump SIMAAI_MEMORY_HEAD_ABI")
+SIMAAI_MEM_HEAD_MEMBER(vaddr);
+SIMAAI_MEM_HEAD_MEMBER(size);
+SIMAAI_MEM_HEAD_MEMBER(phys_addr);
+SIMAAI_MEM_HEAD_MEMBER(bus_addr);
+SIMAAI_MEM_HEAD_MEMBER(target);
+
 static int fd = -1;
 
-simaai_memory_t *simaai_memory_alloc_flags(unsigned int size, int target, int flags)
+static uint64_t simaai_memory_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Library locks count how often they had to wait while enabled, see
+ * simaai_memory_set_lock_stats().
+ */
+static struct simaai_memory_lock_stats lock_stats;
+static int lock_stats_enabled;
+
+static void simaai_memory_lock(pthread_mutex_t *lock)
+{
+	uint64_t start;
+
+	if (!__atomic_load_n(&lock_stats_enabled, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(lock);
+		return;
+	}
+
+	__atomic_add_fetch(&lock_stats.acquisitions, 1, __ATOMIC_RELAXED);
+	if (pthread_mutex_trylock(lock) == 0)
+		return;
+
+	start = simaai_memory_time_ns();
+	pthread_mutex_lock(lock);
+	__atomic_add_fetch(&lock_stats.contended, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&lock_stats.wait_ns, simaai_memory_time_ns() - start, __ATOMIC_RELAXED);
+}
+
+void simaai_memory_set_lock_stats(int enable)
+{
+	__atomic_store_n(&lock_stats_enabled, !!enable, __ATOMIC_RELAXED);
+}
+
+void simaai_memory_get_lock_stats(struct simaai_memory_lock_stats *stats)
+{
+	assert(stats);
+
+	stats->acquisitions = __atomic_load_n(&lock_stats.acquisitions, __ATOMIC_RELAXED);
+	stats->contended = __atomic_load_n(&lock_stats.contended, __ATOMIC_RELAXED);
+	stats->wait_ns = __atomic_load_n(&lock_stats.wait_ns, __ATOMIC_RELAXED);
+}
+
+static int simaai_memory_open(void)
+{
+#ifdef SIMAAI_MEM_EMULATION
+	if (simaai_memory_emu_enabled())
+		return simaai_memory_emu_open();
+#endif
+
+	return open(SIMAAI_ALLOCATOR, O_RDWR | O_SYNC);
+}
+
+static int simaai_memory_ioctl(int fd, unsigned long request, void *arg)
+{
+#ifdef SIMAAI_MEM_EMULATION
+	if (simaai_memory_emu_enabled())
+		return simaai_memory_emu_ioctl(request, arg);
+#endif
+
+	return ioctl(fd, request, arg);
+}
+
+static off_t simaai_memory_mmap_offset(uint64_t phys_addr)
+{
+#ifdef SIMAAI_MEM_EMULATION
+	if (simaai_memory_emu_enabled())
+		return simaai_memory_emu_mmap_offset(phys_addr);
+#endif
+
+	return phys_addr;
+}
+
+/*
+ * Registry of the chunks held by this process, used for per-target
+ * accounting and snapshots.
+ */
+struct simaai_memory_usage {
+	/* Bytes held on the target */
+	uint64_t used;
+	/* Number of live allocations on the target */
+	uint32_t live;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static simaai_memory_t *registry_head;
+static struct simaai_memory_usage registry_usage[SIMAAI_MEM_NUM_TARGETS];
+
+/* Attached chunks are owned by someone else and do not count as usage */
+static int simaai_memory_counts_usage(const simaai_memory_t *memory)
+{
+	return (memory->kind != SIMAAI_MEM_KIND_ATTACH) &&
+	       (memory->target < SIMAAI_MEM_NUM_TARGETS);
+}
+
+/* Bytes held from the driver, pool chunks are larger than the request */
+static uint64_t simaai_memory_chunk_size(const simaai_memory_t *memory)
+{
+	return memory->pool_size ? memory->pool_size : memory->size;
+}
+
+static void simaai_memory_register(simaai_memory_t *memory, int kind)
+{
+	memory->kind = kind;
+
+	simaai_memory_lock(&registry_lock);
+	memory->reg_prev = NULL;
+	memory->reg_next = registry_head;
+	if (registry_head)
+		registry_head->reg_prev = memory;
+	registry_head = memory;
+
+	if (simaai_memory_counts_usage(memory)) {
+		registry_usage[memory->target].used += simaai_memory_chunk_size(memory);
+		registry_usage[memory->target].live++;
+	}
+	pthread_mutex_unlock(&registry_lock);
+}
+
+static void simaai_memory_set_kind(simaai_memory_t *memory, int kind)
+{
+	simaai_memory_lock(&registry_lock);
+	memory->kind = kind;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+static void simaai_memory_unregister(simaai_memory_t *memory)
+{
+	simaai_memory_lock(&registry_lock);
+	if (memory->reg_prev)
+		memory->reg_prev->reg_next = memory->reg_next;
+	else
+		registry_head = memory->reg_next;
+	if (memory->reg_next)
+		memory->reg_next->reg_prev = memory->reg_prev;
+	memory->reg_prev = memory->reg_next = NULL;
+
+	if (simaai_memory_counts_usage(memory)) {
+		registry_usage[memory->target].used -= simaai_memory_chunk_size(memory);
+		registry_usage[memory->target].live--;
+	}
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/*
+ * Segments allocated with SIMAAI_MEM_FLAG_SHARED_MAP map their parent chunk
+ * once. The mapping is created by the first segment mapped and counted per
+ * mapped segment.
+ */
+struct simaai_memory_group {
+	pthread_mutex_t lock;
+	/* Physical address of the parent chunk */
+	uint64_t phys_addr;
+	/* Bytes of the parent chunk covered by the segments */
+	uint64_t length;
+	/* Mapping of the parent chunk, NULL when no segment is mapped */
+	void *vaddr;
+	/* Mapped segments */
+	unsigned int maps;
+	/* Segments not freed yet */
+	unsigned int members;
+};
+
+static simaai_memory_t *simaai_memory_pool_get(uint64_t size, int target, int flags);
+static int simaai_memory_clear(simaai_memory_t *memory);
+static int simaai_memory_defer_free(simaai_memory_t *memory);
+static int simaai_memory_reclaim(void);
+static int simaai_memory_pool_put(simaai_memory_t *memory);
+
+static simaai_memory_t *simaai_memory_alloc_chunk(uint64_t size, int target, int flags)
 {
 	simaai_memory_t *memory;
 	struct simaai_alloc_args alloc_args = {0};
 	int ret;
 
+	/* Refuse sizes the driver interface would silently truncate */
+	alloc_args.size[0] = size;
+	if (alloc_args.size[0] != size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
 	memory = calloc(1, sizeof(*memory));
 	if (!memory)
 		return NULL;
 
 	if(fd < 0)
-		fd = open(SIMAAI_ALLOCATOR, O_RDWR | O_SYNC);
+		fd = simaai_memory_open();
 
 	if (fd < 0) {
 		free(memory);
@@ -53,10 +292,12 @@ simaai_memory_t *simaai_memory_alloc_flags(unsigned int size, int target, int fl
 	}
 
 	alloc_args.num_of_segments = 1;
-	alloc_args.size[0] = size;
-	alloc_args.flags = flags;
+	alloc_args.flags = flags & ~SIMAAI_MEM_LIBRARY_FLAGS;
 	alloc_args.target = target;
-	ret = ioctl(fd, SIMAAI_IOC_MEM_ALLOC_COHERENT, &alloc_args);
+	ret = simaai_memory_ioctl(fd, SIMAAI_IOC_MEM_ALLOC_COHERENT, &alloc_args);
+	/* Memory may be waiting in the deferred free queue */
+	if ((ret < 0) && simaai_memory_reclaim())
+		ret = simaai_memory_ioctl(fd, SIMAAI_IOC_MEM_ALLOC_COHERENT, &alloc_args);
 
 	if (ret < 0) {
 		free(memory);
@@ -64,17 +305,135 @@ simaai_memory_t *simaai_memory_alloc_flags(unsigned int size, int target, int fl
 	}
 
 	memory->target = target;
+	memory->flags = flags & ~SIMAAI_MEM_LIBRARY_FLAGS;
 	memory->offset = alloc_args.offset[0];
 	memory->size = alloc_args.size[0];
 	memory->phys_addr = alloc_args.phys_addr[0];
 	memory->bus_addr = alloc_args.bus_addr[0];
+	simaai_memory_register(memory, SIMAAI_MEM_KIND_ALLOC);
+
+	if ((flags & SIMAAI_MEM_FLAG_ZERO) && (simaai_memory_clear(memory) < 0)) {
+		simaai_memory_free(memory);
+		return NULL;
+	}
 
 	return memory;
 }
 
+simaai_memory_t *simaai_memory_alloc_flags64(uint64_t size, int target, int flags)
+{
+	simaai_memory_t *memory;
+
+	memory = simaai_memory_pool_get(size, target, flags);
+	if (memory)
+		return memory;
+
+	return simaai_memory_alloc_chunk(size, target, flags);
+}
+
+simaai_memory_t *simaai_memory_alloc_flags(unsigned int size, int target, int flags)
+{
+	return simaai_memory_alloc_flags64(size, target, flags);
+}
+
+simaai_memory_t *simaai_memory_alloc64(uint64_t size, int target)
+{
+	return simaai_memory_alloc_flags64(size, target, SIMAAI_MEM_FLAG_DEFAULT);
+}
+
 simaai_memory_t *simaai_memory_alloc(unsigned int size, int target)
 {
-	return simaai_memory_alloc_flags(size, target, SIMAAI_MEM_FLAG_DEFAULT);
+	return simaai_memory_alloc_flags64(size, target, SIMAAI_MEM_FLAG_DEFAULT);
+}
+
+/* Share one mapping between segments of the same parent chunk */
+static void simaai_memory_group_create(simaai_memory_t **segments, unsigned int num_of_segments)
+{
+	struct simaai_memory_group *group;
+	uint64_t base, end, length = 0;
+	unsigned int iter;
+
+	base = segments[0]->phys_addr - segments[0]->offset;
+	for (iter = 0; iter < num_of_segments; iter++) {
+		if ((segments[iter]->phys_addr - segments[iter]->offset != base) ||
+		    __builtin_add_overflow(segments[iter]->offset, segments[iter]->size, &end))
+			return;
+		if (end > length)
+			length = end;
+	}
+
+	if (length > SIZE_MAX)
+		return;
+
+	/* Without a group every segment is mapped on its own */
+	group = calloc(1, sizeof(*group));
+	if (!group)
+		return;
+
+	pthread_mutex_init(&group->lock, NULL);
+	group->phys_addr = base;
+	group->length = length;
+	group->members = num_of_segments;
+	for (iter = 0; iter < num_of_segments; iter++)
+		segments[iter]->group = group;
+}
+
+static void *simaai_memory_group_map(simaai_memory_t *memory)
+{
+	struct simaai_memory_group *group = memory->group;
+	void *vaddr;
+
+	simaai_memory_lock(&group->lock);
+	if (!memory->vaddr) {
+		if (!group->vaddr) {
+			vaddr = mmap(NULL, group->length, PROT_READ | PROT_WRITE,
+				     MAP_SHARED, fd, simaai_memory_mmap_offset(group->phys_addr));
+			if (vaddr == MAP_FAILED) {
+				pthread_mutex_unlock(&group->lock);
+				return NULL;
+			}
+			group->vaddr = vaddr;
+		}
+		group->maps++;
+		memory->vaddr = group->vaddr + memory->offset;
+	}
+	pthread_mutex_unlock(&group->lock);
+
+	return memory->vaddr;
+}
+
+static void simaai_memory_group_unmap(simaai_memory_t *memory)
+{
+	struct simaai_memory_group *group = memory->group;
+
+	simaai_memory_lock(&group->lock);
+	if (memory->vaddr) {
+		memory->vaddr = NULL;
+		if (--group->maps == 0) {
+			munmap(group->vaddr, group->length);
+			group->vaddr = NULL;
+		}
+	}
+	pthread_mutex_unlock(&group->lock);
+}
+
+/* Drop a segment from its group, the last segment releases the group */
+static void simaai_memory_group_leave(simaai_memory_t *memory)
+{
+	struct simaai_memory_group *group = memory->group;
+	unsigned int members;
+
+	simaai_memory_group_unmap(memory);
+
+	simaai_memory_lock(&group->lock);
+	members = --group->members;
+	pthread_mutex_unlock(&group->lock);
+	memory->group = NULL;
+
+	if (!members) {
+		pthread_mutex_destroy(&group->lock);
+		free(group);
+	}
 }
 
 static void free_segment_memory(struct simaai_memory_t **segments_memory, unsigned int last_index)
@@ -84,8 +443,8 @@ static void free_segment_memory(struct simaai_memory_t **segments_memory, unsign
 		free(segments_memory[iter]);
 }
 
-simaai_memory_t **simaai_memory_alloc_segments_flags(uint32_t *segments, uint32_t num_of_segments,
-		int target, int flags)
+simaai_memory_t **simaai_memory_alloc_segments_flags64(const uint64_t *segments,
+		uint32_t num_of_segments, int target, int flags)
 {
 
 	simaai_memory_t **segments_memory;
@@ -102,7 +461,7 @@ simaai_memory_t **simaai_memory_alloc_segments_flags(uint32_t *segments, uint32_
 		return NULL;
 
 	if(fd < 0)
-		fd = open(SIMAAI_ALLOCATOR, O_RDWR | O_SYNC);
+		fd = simaai_memory_open();
 
 	if (fd < 0) {
 		free(segments_memory);
@@ -110,12 +469,20 @@ simaai_memory_t **simaai_memory_alloc_segments_flags(uint32_t *segments, uint32_
 	}
 
 	alloc_args.num_of_segments = num_of_segments;
-	alloc_args.flags = flags;
+	alloc_args.flags = flags & ~SIMAAI_MEM_LIBRARY_FLAGS;
 	alloc_args.target = target;
-	for (iter  = 0; iter < num_of_segments; iter++)
+	for (iter  = 0; iter < num_of_segments; iter++) {
 		alloc_args.size[iter] = segments[iter];
+		if (alloc_args.size[iter] != segments[iter]) {
+			free(segments_memory);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
 
-	ret = ioctl(fd, SIMAAI_IOC_MEM_ALLOC_COHERENT, &alloc_args);
+	ret = simaai_memory_ioctl(fd, SIMAAI_IOC_MEM_ALLOC_COHERENT, &alloc_args);
+	if ((ret < 0) && simaai_memory_reclaim())
+		ret = simaai_memory_ioctl(fd, SIMAAI_IOC_MEM_ALLOC_COHERENT, &alloc_args);
 	if (ret < 0) {
 		free(segments_memory);
 		return NULL;
@@ -132,15 +499,46 @@ simaai_memory_t **simaai_memory_alloc_segments_flags(uint32_t *segments, uint32_
 
 		segments_memory[iter] = memory;
 		memory->target = target;
+		memory->flags = flags & ~SIMAAI_MEM_LIBRARY_FLAGS;
 		memory->offset = alloc_args.offset[iter];
 		memory->size = alloc_args.size[iter];
 		memory->phys_addr = alloc_args.phys_addr[iter];
 		memory->bus_addr = alloc_args.bus_addr[iter];
 	}
 
+	if ((flags & SIMAAI_MEM_FLAG_SHARED_MAP) && num_of_segments)
+		simaai_memory_group_create(segments_memory, num_of_segments);
+
+	for (iter = 0; iter < num_of_segments; iter++)
+		simaai_memory_register(segments_memory[iter], SIMAAI_MEM_KIND_SEGMENT);
+
+	if (flags & SIMAAI_MEM_FLAG_ZERO) {
+		for (iter = 0; iter < num_of_segments; iter++) {
+			if (simaai_memory_clear(segments_memory[iter]) < 0) {
+				simaai_memory_free_segments(segments_memory, num_of_segments);
+				return NULL;
+			}
+		}
+	}
+
 	return segments_memory;
 }
 
+simaai_memory_t **simaai_memory_alloc_segments_flags(uint32_t *segments, uint32_t num_of_segments,
+		int target, int flags)
+{
+	uint64_t segments64[MAX_SEGMENTS];
+	unsigned int iter = 0;
+
+	if (num_of_segments > MAX_SEGMENTS)
+		return NULL;
+
+	for (iter = 0; iter < num_of_segments; iter++)
+		segments64[iter] = segments[iter];
+
+	return simaai_memory_alloc_segments_flags64(segments64, num_of_segments, target, flags);
+}
+
 simaai_memory_t **simaai_memory_alloc_segments(uint32_t *segments, uint32_t num_of_segments, int target)
 {
 	return simaai_memory_alloc_segments_flags(segments, num_of_segments, target, SIMAAI_MEM_FLAG_DEFAULT);
@@ -155,7 +553,7 @@ simaai_memory_t *simaai_memory_attach(uint64_t phys_addr)
 		return NULL;
 
 	if(fd < 0)
-		fd = open(SIMAAI_ALLOCATOR, O_RDWR | O_SYNC);
+		fd = simaai_memory_open();
 
 	if (fd < 0) {
 		free(memory);
@@ -163,7 +561,7 @@ simaai_memory_t *simaai_memory_attach(uint64_t phys_addr)
 	}
 
 	info.phys_addr = phys_addr;
-	if (ioctl(fd, SIMAAI_IOC_MEM_INFO, &info) < 0) {
+	if (simaai_memory_ioctl(fd, SIMAAI_IOC_MEM_INFO, &info) < 0) {
 		free(memory);
 		return NULL;
 	}
@@ -173,28 +571,72 @@ simaai_memory_t *simaai_memory_attach(uint64_t phys_addr)
 	memory->size = info.size;
 	memory->phys_addr = info.phys_addr;
 	memory->bus_addr = info.bus_addr;
+	simaai_memory_register(memory, SIMAAI_MEM_KIND_ATTACH);
 
 	return memory;
 }
 
+/*
+ * Drop a slice reference. The last slice of a chunk that was already freed
+ * by its owner frees it.
+ */
+static void simaai_memory_put_ref(simaai_memory_t *memory)
+{
+	if (__atomic_fetch_sub(&memory->refs, 1, __ATOMIC_ACQ_REL) == (SIMAAI_MEM_REFS_RELEASED | 1)) {
+		memory->refs = 0;
+		simaai_memory_free(memory);
+	}
+}
+
 void simaai_memory_free(simaai_memory_t *memory)
 {
 	struct simaai_free_args free_args = {0};
+	simaai_memory_t *parent;
 
 	assert(memory);
 
+	/* Still used by slices, the last one frees it */
+	if (__atomic_fetch_or(&memory->refs, SIMAAI_MEM_REFS_RELEASED, __ATOMIC_ACQ_REL) &
+	    ~SIMAAI_MEM_REFS_RELEASED)
+		return;
+
+	if (memory->kind == SIMAAI_MEM_KIND_SLICE) {
+		parent = memory->parent;
+		free(memory);
+		simaai_memory_put_ref(parent);
+		return;
+	}
+
+	/* Arena buffers are released by simaai_memory_arena_reset() */
+	if (memory->parent) {
+		memory->refs = 0;
+		return;
+	}
+	memory->refs = 0;
+
+	if (memory->pool && (simaai_memory_pool_put(memory) == 0))
+		return;
+
+	if (simaai_memory_defer_free(memory) == 0)
+		return;
+
 	if(fd < 0)
-		fd = open(SIMAAI_ALLOCATOR, O_RDWR | O_SYNC);
+		fd = simaai_memory_open();
 
 	if (fd < 0) {
 		return;
 	}
 
-	if (memory->vaddr)
-		munmap(memory->vaddr - memory->offset, memory->size);
+	if (memory->pool_vaddr)
+		memory->vaddr = memory->pool_vaddr;
+	if (memory->group)
+		simaai_memory_group_leave(memory);
+	else if (memory->vaddr)
+		munmap(memory->vaddr - memory->offset, simaai_memory_chunk_size(memory) + memory->offset);
 	free_args.num_of_segments = 1;
 	free_args.phys_addr[0] = memory->phys_addr;
-	ioctl(fd, SIMAAI_IOC_MEM_FREE, &free_args);
+	simaai_memory_ioctl(fd, SIMAAI_IOC_MEM_FREE, &free_args);
+	simaai_memory_unregister(memory);
 	free(memory);
 }
 
@@ -202,44 +644,84 @@ void simaai_memory_free_segments(simaai_memory_t **segments, unsigned int num_of
 {
 	struct simaai_free_args free_args = {0};
 	unsigned int iter = 0;
+	unsigned int count = 0;
 
 	assert(segments);
 
 	if(fd < 0)
-		fd = open(SIMAAI_ALLOCATOR, O_RDWR | O_SYNC);
+		fd = simaai_memory_open();
 
 	if (fd < 0) {
 		return;
 	}
 
-	free_args.num_of_segments = num_of_segments;
 	for (iter = 0; iter < num_of_segments; iter++) {
 
 		assert(segments[iter]);
-		if (segments[iter]->vaddr)
-			munmap(segments[iter]->vaddr - segments[iter]->offset, segments[iter]->size);
-		free_args.phys_addr[iter] = segments[iter]->phys_addr;
+		/* Still used by slices, the last one frees the segment alone */
+		if (__atomic_fetch_or(&segments[iter]->refs, SIMAAI_MEM_REFS_RELEASED, __ATOMIC_ACQ_REL) &
+		    ~SIMAAI_MEM_REFS_RELEASED)
+			continue;
+		segments[iter]->refs = 0;
+
+		if (segments[iter]->group) {
+			simaai_memory_group_leave(segments[iter]);
+		} else if (segments[iter]->vaddr) {
+			munmap(segments[iter]->vaddr - segments[iter]->offset,
+			       segments[iter]->size + segments[iter]->offset);
+		}
+		free_args.phys_addr[count++] = segments[iter]->phys_addr;
 
+		simaai_memory_unregister(segments[iter]);
 		free(segments[iter]);
 	}
 
-	ioctl(fd, SIMAAI_IOC_MEM_FREE, &free_args);
+	free_args.num_of_segments = count;
+	if (count)
+		simaai_memory_ioctl(fd, SIMAAI_IOC_MEM_FREE, &free_args);
 	free(segments);
 }
 
 void *simaai_memory_map(simaai_memory_t *memory)
 {
+	uint64_t length;
+
 	assert(memory);
 
+	/* Pool chunks stay mapped for their whole lifetime */
+	if (memory->pool_vaddr) {
+		memory->vaddr = memory->pool_vaddr;
+		return memory->vaddr;
+	}
+
+	/* Carved chunks share the mapping of their parent */
+	if (memory->parent) {
+		if (!memory->parent->vaddr && !simaai_memory_map(memory->parent))
+			return NULL;
+		memory->vaddr = memory->parent->vaddr + (memory->phys_addr - memory->parent->phys_addr);
+		return memory->vaddr;
+	}
+
+	if ((memory->offset > memory->phys_addr) ||
+	    __builtin_add_overflow(memory->size, memory->offset, &length) ||
+	    (length > SIZE_MAX)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
 	if(fd < 0)
-		fd = open(SIMAAI_ALLOCATOR, O_RDWR | O_SYNC);
+		fd = simaai_memory_open();
 
 	if (fd < 0) {
 		return NULL;
 	}
 
-	void *vaddr = mmap(NULL, (memory->size + memory->offset), PROT_READ | PROT_WRITE,
-			   MAP_SHARED, fd, (memory->phys_addr - memory->offset));
+	/* Segments of a group share the parent chunk mapping */
+	if (memory->group)
+		return simaai_memory_group_map(memory);
+
+	void *vaddr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, simaai_memory_mmap_offset(memory->phys_addr - memory->offset));
 
 	if (vaddr == MAP_FAILED)
 		vaddr = NULL;
@@ -249,10 +731,54 @@ void *simaai_memory_map(simaai_memory_t *memory)
 	return memory->vaddr;
 }
 
+int simaai_memory_map_segments(simaai_memory_t **segments, unsigned int num_of_segments)
+{
+	int mapped_here[MAX_SEGMENTS];
+	unsigned int iter;
+
+	assert(segments);
+
+	if (num_of_segments > MAX_SEGMENTS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (iter = 0; iter < num_of_segments; iter++) {
+		assert(segments[iter]);
+		mapped_here[iter] = !segments[iter]->vaddr;
+		if (!simaai_memory_map(segments[iter]))
+			break;
+	}
+
+	if (iter == num_of_segments)
+		return 0;
+
+	while (iter--) {
+		if (mapped_here[iter])
+			simaai_memory_unmap(segments[iter]);
+	}
+
+	return -1;
+}
+
 void simaai_memory_unmap(simaai_memory_t *memory)
 {
 	assert(memory);
 
+	/* Slices point into the mapping, it is kept until they are freed */
+	if (__atomic_load_n(&memory->refs, __ATOMIC_ACQUIRE) & ~SIMAAI_MEM_REFS_RELEASED)
+		return;
+
+	if (memory->pool_vaddr || memory->parent) {
+		memory->vaddr = NULL;
+		return;
+	}
+
+	if (memory->group) {
+		simaai_memory_group_unmap(memory);
+		return;
+	}
+
 	if (memory->vaddr) {
 		munmap(memory->vaddr - memory->offset, memory->size + memory->offset);
 		memory->vaddr = NULL;
@@ -290,6 +816,41 @@ size_t simaai_memory_get_size(simaai_memory_t *memory)
 	return memory->size;
 }
 
+simaai_memory_t *simaai_memory_slice(simaai_memory_t *parent, uint64_t offset, uint64_t size)
+{
+	simaai_memory_t *memory;
+
+	assert(parent);
+
+	if ((size == 0) || (offset > parent->size) || (size > parent->size - offset)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	memory = calloc(1, sizeof(*memory));
+	if (!memory)
+		return NULL;
+
+	if (parent->vaddr)
+		memory->vaddr = parent->vaddr + offset;
+	memory->size = size;
+	memory->phys_addr = parent->phys_addr + offset;
+	memory->bus_addr = parent->bus_addr + offset;
+	memory->target = parent->target;
+	memory->offset = parent->offset + offset;
+	memory->flags = parent->flags;
+	memory->kind = SIMAAI_MEM_KIND_SLICE;
+	memory->parent = parent;
+	__atomic_add_fetch(&parent->refs, 1, __ATOMIC_ACQ_REL);
+
+	return memory;
+}
+
+int simaai_memory_get_head_abi(void)
+{
+	return SIMAAI_MEMORY_HEAD_ABI;
+}
+
 uint32_t simaai_memory_get_target(simaai_memory_t *memory)
 {
 	assert(memory);
@@ -297,37 +858,81 @@ uint32_t simaai_memory_get_target(simaai_memory_t *memory)
 	return memory->target;
 }
 
-static void simaai_memory_exec_op_cvac(uint64_t start, uint64_t size)
+/*
+ * Cache line operations are split from the barrier that completes them so
+ * that batches of ranges can share a single barrier. Ranges are widened to
+ * whole cache lines, a partial first line is part of the range.
+ */
+#if defined(__aarch64__)
+static void simaai_memory_lines_cvac(uint64_t start, uint64_t end)
 {
 	uint64_t i;
 
-	for (i = start; i < (start + size); i += SIMAAI_CACHE_LINE_SIZE) {
+	for (i = start & ~(uint64_t)(SIMAAI_CACHE_LINE_SIZE - 1); i < end; i += SIMAAI_CACHE_LINE_SIZE) {
 		__asm__ __volatile__("dc cvac, %0\n\t" : : "r" (i) :"memory");
 	}
-	__asm__ __volatile__("dsb st\n\t" : : :"memory");
 }
 
-static void simaai_memory_exec_op_civac(uint64_t start, uint64_t size)
+static void simaai_memory_lines_civac(uint64_t start, uint64_t end)
 {
 	uint64_t i;
 
-	for (i = start; i < (start + size); i += SIMAAI_CACHE_LINE_SIZE) {
+	for (i = start & ~(uint64_t)(SIMAAI_CACHE_LINE_SIZE - 1); i < end; i += SIMAAI_CACHE_LINE_SIZE) {
 		__asm__ __volatile__("dc civac, %0\n\t" : : "r" (i) :"memory");
 	}
-	__asm__ __volatile__("dsb sy\n\t" : : :"memory");
+}
+
+static void simaai_memory_barrier(int invalidate)
+{
+	if (invalidate)
+		__asm__ __volatile__("dsb sy\n\t" : : :"memory");
+	else
+		__asm__ __volatile__("dsb st\n\t" : : :"memory");
+}
+#elif defined(SIMAAI_MEM_EMULATION)
+/*
+ * Host builds only work with the emulated backend, whose memory is coherent
+ * with the CPU caches.
+ */
+static void simaai_memory_lines_cvac(uint64_t start, uint64_t end)
+{
+}
+
+static void simaai_memory_lines_civac(uint64_t start, uint64_t end)
+{
+}
+
+static void simaai_memory_barrier(int invalidate)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+#else
+#error "Cache maintenance is only implemented for aarch64, build host libraries with EMULATE=1"
+#endif
+
+static void simaai_memory_exec_op_cvac(uint64_t start, uint64_t size)
+{
+	simaai_memory_lines_cvac(start, start + size);
+	simaai_memory_barrier(0);
+}
+
+static void simaai_memory_exec_op_civac(uint64_t start, uint64_t size)
+{
+	simaai_memory_lines_civac(start, start + size);
+	simaai_memory_barrier(1);
 }
 
 static void simaai_memory_op_cache(simaai_memory_t *memory,
-		unsigned int offset, unsigned int size, const char op)
+		uint64_t offset, uint64_t size, const char op)
 {
 	assert(memory);
 	if (!memory->vaddr)
 		return;
 
-	if (size == 0)
-		size = memory->size;
+	if (offset >= memory->size)
+		return;
 
-	if ((offset + size) > memory->size)
+	if ((size == 0) || (size > memory->size - offset))
 		size = memory->size - offset;
 
 	if (op == 'c')
@@ -347,6 +952,12 @@ void simaai_memory_flush_cache_part(simaai_memory_t *memory,
 	simaai_memory_op_cache(memory, offset, size, 'c');
 }
 
+void simaai_memory_flush_cache_part64(simaai_memory_t *memory,
+		uint64_t offset, uint64_t size)
+{
+	simaai_memory_op_cache(memory, offset, size, 'c');
+}
+
 void simaai_memory_invalidate_cache(simaai_memory_t *memory)
 {
 	simaai_memory_op_cache(memory, 0, 0, 'i');
@@ -358,51 +969,2626 @@ void simaai_memory_invalidate_cache_part(simaai_memory_t *memory,
 	simaai_memory_op_cache(memory, offset, size, 'i');
 }
 
-simaai_memory_t*  simaai_memcpy(simaai_memory_t *dst, simaai_memory_t *src)
+void simaai_memory_invalidate_cache_part64(simaai_memory_t *memory,
+		uint64_t offset, uint64_t size)
 {
-	struct simaai_memcpy_args memcpy_args = {0};
-	int ret;
+	simaai_memory_op_cache(memory, offset, size, 'i');
+}
 
-	if(fd < 0)
-		fd = open(SIMAAI_ALLOCATOR, O_RDWR | O_SYNC);
+static int simaai_memcpy_dma(uint64_t dst_addr, uint64_t src_addr, uint64_t size);
 
-	if (fd < 0) {
+simaai_memory_t*  simaai_memcpy(simaai_memory_t *dst, simaai_memory_t *src)
+{
+	uint64_t size;
+
+	size = (src->size > dst->size) ? (dst->size): (src->size);
+	if (simaai_memcpy_dma(dst->phys_addr, src->phys_addr, size) < 0)
 		return NULL;
-	}
 
-	memcpy_args.src_addr = src->phys_addr;
-	memcpy_args.dst_addr = dst->phys_addr;
-	memcpy_args.size = (src->size > dst->size) ? (dst->size): (src->size);
+	return dst;
+}
 
-	ret = ioctl(fd, SIMAAI_IOC_MEMCPY, &memcpy_args);
-	if (ret < 0) {
+simaai_memory_t*  simaai_memcpy_part(simaai_memory_t *dst, uint64_t dst_offset, simaai_memory_t *src, uint64_t src_offset, uint64_t size)
+{
+	if ((size > dst->size) || (dst_offset > dst->size - size) ||
+	    (size > src->size) || (src_offset > src->size - size))
+		return NULL;
+
+	if (simaai_memcpy_dma(dst->phys_addr + dst_offset, src->phys_addr + src_offset, size) < 0)
 		return NULL;
-	}
 
 	return dst;
 }
 
-simaai_memory_t*  simaai_memcpy_part(simaai_memory_t *dst, uint64_t dst_offset, simaai_memory_t *src, uint64_t src_offset, uint64_t size)
+/*
+ * Memcpy dispatcher.
+ *
+ * Every (source target, destination target, source cached, destination
+ * cached) combination keeps a mask of size classes for which a CPU copy
+ * through the mappings is cheaper than a SIMAAI_IOC_MEMCPY round trip.
+ * Bit n of the mask covers copies of [2^n, 2^(n+1)) bytes. Masks come from
+ * a saved profile or are calibrated on first use.
+ *
+ * Dispatch reads an entry without locking once its ready flag is set. The
+ * first copy that finds an entry not ready calibrates it, copies running
+ * meanwhile use the default mask instead of waiting.
+ */
+#define SIMAAI_MEMCPY_NUM_BUCKETS	(32)
+#define SIMAAI_MEMCPY_CALIB_MIN_SHIFT	(8)
+#define SIMAAI_MEMCPY_CALIB_MAX_SHIFT	(22)
+#define SIMAAI_MEMCPY_CALIB_MIN_SIZE	(64 * 1024)
+#define SIMAAI_MEMCPY_CALIB_REPS	(3)
+/* CPU copies below 4 KiB until calibrated */
+#define SIMAAI_MEMCPY_DEFAULT_CPU_MASK	((1u << 12) - 1)
+
+struct simaai_memcpy_profile {
+	/* Size classes where the CPU copy wins */
+	uint32_t cpu_mask;
+	/* Entry was calibrated or loaded from a profile, set after cpu_mask */
+	int valid;
+	/* A thread claimed the calibration on use of this entry */
+	int calibrating;
+};
+
+static struct simaai_memcpy_profile
+memcpy_profile[SIMAAI_MEM_NUM_TARGETS][SIMAAI_MEM_NUM_TARGETS][2][2];
+/* Serializes profile file loads and saves */
+static pthread_mutex_t memcpy_profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t memcpy_profile_once = PTHREAD_ONCE_INIT;
+static int memcpy_calibrate_on_use = 1;
+
+
+static int simaai_memcpy_ioctl(uint64_t dst_addr, uint64_t src_addr, uint64_t size)
 {
 	struct simaai_memcpy_args memcpy_args = {0};
+
+	if(fd < 0)
+		fd = simaai_memory_open();
+
+	if (fd < 0)
+		return -1;
+
+	memcpy_args.src_addr = src_addr;
+	memcpy_args.dst_addr = dst_addr;
+	memcpy_args.size = size;
+
+	return simaai_memory_ioctl(fd, SIMAAI_IOC_MEMCPY, &memcpy_args) < 0 ? -1 : 0;
+}
+
+/*
+ * Memcpy priority classes.
+ *
+ * Every driver copy runs in the priority class of the calling thread.
+ * Low priority copies are split into chunks, default priority copies only
+ * while a high priority copy is in progress, and before each chunk the
+ * copy waits while a copy of a higher class is in progress. Overlapping
+ * copies are never split. A high priority copy arriving during a default
+ * copy waits for the part of it already submitted. Latencies are kept per class in a
+ * histogram with 8 sub-buckets per power of two nanoseconds.
+ */
+#define SIMAAI_MEMCPY_NUM_PRIOS		(SIMAAI_MEMCPY_PRIO_LOW + 1)
+#define SIMAAI_MEMCPY_QOS_CHUNK		(1024 * 1024)
+#define SIMAAI_MEMCPY_LAT_SUB_SHIFT	(3)
+#define SIMAAI_MEMCPY_LAT_BUCKETS	(64 << SIMAAI_MEMCPY_LAT_SUB_SHIFT)
+
+struct simaai_memcpy_qos_class {
+	/* Copies in progress */
+	unsigned int active;
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t preemptions;
+	uint64_t buckets[SIMAAI_MEMCPY_LAT_BUCKETS];
+};
+
+static struct simaai_memcpy_qos_class memcpy_qos[SIMAAI_MEMCPY_NUM_PRIOS];
+static pthread_mutex_t memcpy_qos_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t memcpy_qos_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t memcpy_qos_once = PTHREAD_ONCE_INIT;
+static uint64_t memcpy_qos_chunk = SIMAAI_MEMCPY_QOS_CHUNK;
+static __thread int memcpy_thread_prio = SIMAAI_MEMCPY_PRIO_NORMAL;
+
+static uint64_t simaai_memory_parse_size(const char *str, char **end);
+
+static void simaai_memcpy_qos_init(void)
+{
+	const char *value = getenv("SIMAAI_MEMCPY_CHUNK");
+	uint64_t chunk;
+	char *end;
+
+	if (!value)
+		return;
+
+	chunk = simaai_memory_parse_size(value, &end);
+	if (chunk && (*end == '\0'))
+		memcpy_qos_chunk = chunk;
+}
+
+static unsigned int simaai_memcpy_lat_bucket(uint64_t ns)
+{
+	unsigned int msb = 63 - __builtin_clzll(ns | 1);
+
+	if (msb < SIMAAI_MEMCPY_LAT_SUB_SHIFT)
+		return ns;
+
+	return ((msb - SIMAAI_MEMCPY_LAT_SUB_SHIFT + 1) << SIMAAI_MEMCPY_LAT_SUB_SHIFT) |
+	       ((ns >> (msb - SIMAAI_MEMCPY_LAT_SUB_SHIFT)) & ((1u << SIMAAI_MEMCPY_LAT_SUB_SHIFT) - 1));
+}
+
+/* Largest latency that falls into a bucket */
+static uint64_t simaai_memcpy_lat_bucket_max(unsigned int bucket)
+{
+	unsigned int sub = 1u << SIMAAI_MEMCPY_LAT_SUB_SHIFT;
+	unsigned int octave = bucket >> SIMAAI_MEMCPY_LAT_SUB_SHIFT;
+
+	if (octave == 0)
+		return bucket;
+
+	return ((uint64_t)(sub + (bucket & (sub - 1)) + 1) << (octave - 1)) - 1;
+}
+
+static int simaai_memcpy_qos_preempted(int prio)
+{
+	int iter;
+
+	for (iter = 0; iter < prio; iter++) {
+		if (__atomic_load_n(&memcpy_qos[iter].active, __ATOMIC_ACQUIRE))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void simaai_memcpy_qos_wait(int prio)
+{
+	if (!simaai_memcpy_qos_preempted(prio))
+		return;
+
+	__atomic_add_fetch(&memcpy_qos[prio].preemptions, 1, __ATOMIC_RELAXED);
+
+	simaai_memory_lock(&memcpy_qos_lock);
+	while (simaai_memcpy_qos_preempted(prio))
+		pthread_cond_wait(&memcpy_qos_cond, &memcpy_qos_lock);
+	pthread_mutex_unlock(&memcpy_qos_lock);
+}
+
+static void simaai_memcpy_qos_leave(int prio)
+{
+	if ((__atomic_sub_fetch(&memcpy_qos[prio].active, 1, __ATOMIC_ACQ_REL) == 0) &&
+	    (prio < SIMAAI_MEMCPY_NUM_PRIOS - 1)) {
+		simaai_memory_lock(&memcpy_qos_lock);
+		pthread_cond_broadcast(&memcpy_qos_cond);
+		pthread_mutex_unlock(&memcpy_qos_lock);
+	}
+}
+
+static void simaai_memcpy_qos_record(int prio, uint64_t size, uint64_t ns)
+{
+	struct simaai_memcpy_qos_class *qos = &memcpy_qos[prio];
+	uint64_t max = __atomic_load_n(&qos->max_ns, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&qos->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&qos->bytes, size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&qos->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&qos->buckets[simaai_memcpy_lat_bucket(ns)], 1, __ATOMIC_RELAXED);
+	while ((ns > max) &&
+	       !__atomic_compare_exchange_n(&qos->max_ns, &max, ns, 0,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Driver copy in the priority class of the calling thread */
+static int simaai_memcpy_dma(uint64_t dst_addr, uint64_t src_addr, uint64_t size)
+{
+	int prio = memcpy_thread_prio;
+	uint64_t start = simaai_memory_time_ns();
+	uint64_t pos, len;
+	int overlap;
+	int ret = 0;
+
+	pthread_once(&memcpy_qos_once, simaai_memcpy_qos_init);
+
+	__atomic_add_fetch(&memcpy_qos[prio].active, 1, __ATOMIC_ACQ_REL);
+
+	/* Chunks of an overlapping copy would read already written bytes */
+	overlap = (dst_addr < src_addr + size) && (src_addr < dst_addr + size);
+
+	if ((prio == SIMAAI_MEMCPY_PRIO_HIGH) || overlap || (size <= memcpy_qos_chunk)) {
+		simaai_memcpy_qos_wait(prio);
+		ret = simaai_memcpy_ioctl(dst_addr, src_addr, size);
+	} else {
+		for (pos = 0; (pos < size) && (ret == 0); pos += len) {
+			len = size - pos;
+			/*
+			 * Low priority copies are always chunked, the default
+			 * class only while a high priority copy is registered.
+			 */
+			if ((len > memcpy_qos_chunk) &&
+			    ((prio == SIMAAI_MEMCPY_PRIO_LOW) ||
+			     __atomic_load_n(&memcpy_qos[SIMAAI_MEMCPY_PRIO_HIGH].active, __ATOMIC_ACQUIRE)))
+				len = memcpy_qos_chunk;
+
+			simaai_memcpy_qos_wait(prio);
+			ret = simaai_memcpy_ioctl(dst_addr + pos, src_addr + pos, len);
+		}
+	}
+
+	simaai_memcpy_qos_leave(prio);
+	if (ret == 0)
+		simaai_memcpy_qos_record(prio, size, simaai_memory_time_ns() - start);
+
+	return ret;
+}
+
+int simaai_memcpy_set_thread_priority(int prio)
+{
+	int prev = memcpy_thread_prio;
+
+	if ((prio < SIMAAI_MEMCPY_PRIO_HIGH) || (prio >= SIMAAI_MEMCPY_NUM_PRIOS)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy_thread_prio = prio;
+	return prev;
+}
+
+int simaai_memcpy_get_qos_stats(int prio, struct simaai_memcpy_qos_stats *stats)
+{
+	struct simaai_memcpy_qos_class *qos;
+	uint64_t seen = 0, p50 = 0, p99 = 0;
+	unsigned int iter;
+
+	assert(stats);
+
+	if ((prio < SIMAAI_MEMCPY_PRIO_HIGH) || (prio >= SIMAAI_MEMCPY_NUM_PRIOS)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	qos = &memcpy_qos[prio];
+	memset(stats, 0, sizeof(*stats));
+	stats->count = __atomic_load_n(&qos->count, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&qos->bytes, __ATOMIC_RELAXED);
+	stats->max_ns = __atomic_load_n(&qos->max_ns, __ATOMIC_RELAXED);
+	stats->preemptions = __atomic_load_n(&qos->preemptions, __ATOMIC_RELAXED);
+	if (!stats->count)
+		return 0;
+
+	stats->avg_ns = __atomic_load_n(&qos->total_ns, __ATOMIC_RELAXED) / stats->count;
+
+	/* Percentiles are reported as the upper bound of their bucket */
+	for (iter = 0; iter < SIMAAI_MEMCPY_LAT_BUCKETS; iter++) {
+		seen += __atomic_load_n(&qos->buckets[iter], __ATOMIC_RELAXED);
+		if (!p50 && (seen * 100 >= stats->count * 50))
+			p50 = simaai_memcpy_lat_bucket_max(iter);
+		if (!p99 && (seen * 100 >= stats->count * 99)) {
+			p99 = simaai_memcpy_lat_bucket_max(iter);
+			break;
+		}
+	}
+
+	stats->p50_ns = (p50 < stats->max_ns) ? p50 : stats->max_ns;
+	stats->p99_ns = (p99 < stats->max_ns) ? p99 : stats->max_ns;
+
+	return 0;
+}
+
+void simaai_memcpy_reset_qos_stats(void)
+{
+	unsigned int prio, iter;
+
+	for (prio = 0; prio < SIMAAI_MEMCPY_NUM_PRIOS; prio++) {
+		__atomic_store_n(&memcpy_qos[prio].count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&memcpy_qos[prio].bytes, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&memcpy_qos[prio].total_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&memcpy_qos[prio].max_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&memcpy_qos[prio].preemptions, 0, __ATOMIC_RELAXED);
+		for (iter = 0; iter < SIMAAI_MEMCPY_LAT_BUCKETS; iter++)
+			__atomic_store_n(&memcpy_qos[prio].buckets[iter], 0, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Copy through the mappings. Leaves memory in the same state as the driver
+ * copy would: cached source lines are written back before reading, and
+ * cached destination lines are dropped before and cleaned after writing so
+ * that partial lines at the edges do not clobber data behind them.
+ */
+static void simaai_memcpy_cpu(simaai_memory_t *dst, uint64_t dst_offset,
+		simaai_memory_t *src, uint64_t src_offset, uint64_t size)
+{
+	uint64_t dst_va = (uint64_t)dst->vaddr + dst_offset;
+	uint64_t src_va = (uint64_t)src->vaddr + src_offset;
+
+	if (src->flags & SIMAAI_MEM_FLAG_CACHED)
+		simaai_memory_lines_civac(src_va, src_va + size);
+	if (dst->flags & SIMAAI_MEM_FLAG_CACHED)
+		simaai_memory_lines_civac(dst_va, dst_va + size);
+	if ((src->flags | dst->flags) & SIMAAI_MEM_FLAG_CACHED)
+		simaai_memory_barrier(1);
+
+	memmove((void *)dst_va, (const void *)src_va, size);
+
+	if (dst->flags & SIMAAI_MEM_FLAG_CACHED)
+		simaai_memory_exec_op_cvac(dst_va, size);
+}
+
+static unsigned int simaai_memcpy_bucket(uint64_t size)
+{
+	unsigned int bucket = 63 - __builtin_clzll(size | 1);
+
+	return (bucket < SIMAAI_MEMCPY_NUM_BUCKETS) ? bucket : (SIMAAI_MEMCPY_NUM_BUCKETS - 1);
+}
+
+static int simaai_memcpy_valid_target(int target)
+{
+	return (target >= 0) && (target < SIMAAI_MEM_NUM_TARGETS);
+}
+
+static struct simaai_memcpy_profile *simaai_memcpy_entry(int src_target, int src_flags,
+		int dst_target, int dst_flags)
+{
+	return &memcpy_profile[src_target][dst_target]
+		[!!(src_flags & SIMAAI_MEM_FLAG_CACHED)][!!(dst_flags & SIMAAI_MEM_FLAG_CACHED)];
+}
+
+static void simaai_memcpy_load_env_profile(void)
+{
+	const char *path = getenv("SIMAAI_MEMCPY_PROFILE");
+	const char *calibrate = getenv("SIMAAI_MEMCPY_CALIBRATE");
+
+	if (calibrate && (strcmp(calibrate, "0") == 0))
+		memcpy_calibrate_on_use = 0;
+
+	if (path)
+		simaai_memcpy_load_profile(path);
+}
+
+/* Publish a mask to the lock-free readers of the entry */
+static void simaai_memcpy_set_entry(struct simaai_memcpy_profile *entry, uint32_t mask)
+{
+	__atomic_store_n(&entry->cpu_mask, mask, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->valid, 1, __ATOMIC_RELEASE);
+}
+
+static int simaai_memcpy_calibrate_entry(struct simaai_memcpy_profile *entry,
+		int src_target, int src_flags, int dst_target, int dst_flags)
+{
+	simaai_memory_t *src = NULL, *dst = NULL;
+	uint64_t buf_size = 1ull << SIMAAI_MEMCPY_CALIB_MAX_SHIFT;
+	uint64_t dma_ns, cpu_ns, start, elapsed;
+	uint32_t mask = 0;
+	unsigned int shift, last_shift = 0, bit;
+	int rep, cpu_wins = 0, ret = -1;
+
+	src_flags &= SIMAAI_MEM_FLAG_CACHED;
+	dst_flags &= SIMAAI_MEM_FLAG_CACHED;
+
+	/*
+	 * OCM and DMS banks are small, shrink the probe buffers until they fit.
+	 * The buffers come from the driver directly so that calibration does
+	 * not take chunks reserved in the pools.
+	 */
+	for (; buf_size >= SIMAAI_MEMCPY_CALIB_MIN_SIZE; buf_size >>= 1) {
+		src = simaai_memory_alloc_chunk(buf_size, src_target, src_flags);
+		dst = simaai_memory_alloc_chunk(buf_size, dst_target, dst_flags);
+		if (src && dst)
+			break;
+		if (src)
+			simaai_memory_free(src);
+		if (dst)
+			simaai_memory_free(dst);
+		src = dst = NULL;
+	}
+
+	if (!src || !dst)
+		return -1;
+
+	if (!simaai_memory_map(src) || !simaai_memory_map(dst))
+		goto out;
+
+	memset(src->vaddr, 0x5a, buf_size);
+	if (src_flags & SIMAAI_MEM_FLAG_CACHED)
+		simaai_memory_flush_cache(src);
+
+	for (shift = SIMAAI_MEMCPY_CALIB_MIN_SHIFT;
+	     (shift <= SIMAAI_MEMCPY_CALIB_MAX_SHIFT) && ((1ull << shift) <= buf_size);
+	     shift += 2) {
+		dma_ns = cpu_ns = UINT64_MAX;
+
+		for (rep = 0; rep < SIMAAI_MEMCPY_CALIB_REPS; rep++) {
+			start = simaai_memory_time_ns();
+			if (simaai_memcpy_ioctl(dst->phys_addr, src->phys_addr, 1ull << shift) < 0)
+				goto out;
+			elapsed = simaai_memory_time_ns() - start;
+			if (elapsed < dma_ns)
+				dma_ns = elapsed;
+
+			start = simaai_memory_time_ns();
+			simaai_memcpy_cpu(dst, 0, src, 0, 1ull << shift);
+			elapsed = simaai_memory_time_ns() - start;
+			if (elapsed < cpu_ns)
+				cpu_ns = elapsed;
+		}
+
+		/* Each probe decides its own size class and the one above it */
+		cpu_wins = cpu_ns < dma_ns;
+		for (bit = (shift == SIMAAI_MEMCPY_CALIB_MIN_SHIFT) ? 0 : shift; bit <= shift + 1; bit++)
+			if (cpu_wins)
+				mask |= 1u << bit;
+		last_shift = shift;
+	}
+
+	/* Larger copies follow the largest probe */
+	for (bit = last_shift + 2; bit < SIMAAI_MEMCPY_NUM_BUCKETS; bit++)
+		if (cpu_wins)
+			mask |= 1u << bit;
+
+	simaai_memcpy_set_entry(entry, mask);
+	ret = 0;
+out:
+	simaai_memory_free(src);
+	simaai_memory_free(dst);
+	return ret;
+}
+
+static int simaai_memcpy_select(int src_target, int src_flags, int dst_target,
+		int dst_flags, uint64_t size, int calibrate)
+{
+	struct simaai_memcpy_profile *entry;
+	uint32_t mask;
+
+	if (!simaai_memcpy_valid_target(src_target) || !simaai_memcpy_valid_target(dst_target))
+		return SIMAAI_MEMCPY_ENGINE_DMA;
+
+	pthread_once(&memcpy_profile_once, simaai_memcpy_load_env_profile);
+
+	entry = simaai_memcpy_entry(src_target, src_flags, dst_target, dst_flags);
+
+	if (!__atomic_load_n(&entry->valid, __ATOMIC_ACQUIRE) && calibrate && memcpy_calibrate_on_use &&
+	    !__atomic_exchange_n(&entry->calibrating, 1, __ATOMIC_ACQ_REL)) {
+		/* Do not retry on every copy */
+		if (simaai_memcpy_calibrate_entry(entry, src_target, src_flags,
+						  dst_target, dst_flags) < 0)
+			simaai_memcpy_set_entry(entry, SIMAAI_MEMCPY_DEFAULT_CPU_MASK);
+	}
+
+	if (__atomic_load_n(&entry->valid, __ATOMIC_ACQUIRE))
+		mask = __atomic_load_n(&entry->cpu_mask, __ATOMIC_RELAXED);
+	else
+		mask = SIMAAI_MEMCPY_DEFAULT_CPU_MASK;
+
+	return (mask & (1u << simaai_memcpy_bucket(size))) ?
+		SIMAAI_MEMCPY_ENGINE_CPU : SIMAAI_MEMCPY_ENGINE_DMA;
+}
+
+int simaai_memcpy_calibrate(int src_target, int src_flags, int dst_target, int dst_flags)
+{
+	struct simaai_memcpy_profile *entry;
+
+	if (!simaai_memcpy_valid_target(src_target) || !simaai_memcpy_valid_target(dst_target))
+		return -1;
+
+	pthread_once(&memcpy_profile_once, simaai_memcpy_load_env_profile);
+
+	entry = simaai_memcpy_entry(src_target, src_flags, dst_target, dst_flags);
+
+	return simaai_memcpy_calibrate_entry(entry, src_target, src_flags, dst_target, dst_flags);
+}
+
+int simaai_memcpy_get_engine(int src_target, int src_flags, int dst_target,
+		int dst_flags, uint64_t size)
+{
+	return simaai_memcpy_select(src_target, src_flags, dst_target, dst_flags, size, 0);
+}
+
+int simaai_memcpy_load_profile(const char *path)
+{
+	struct simaai_memcpy_profile *entry;
+	int src_target, dst_target, src_cached, dst_cached;
+	unsigned int mask;
+	char line[128];
+	FILE *file;
+
+	assert(path);
+
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	simaai_memory_lock(&memcpy_profile_lock);
+	while (fgets(line, sizeof(line), file)) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%d %d %d %d %x", &src_target, &dst_target,
+			   &src_cached, &dst_cached, &mask) != 5)
+			continue;
+		if (!simaai_memcpy_valid_target(src_target) || !simaai_memcpy_valid_target(dst_target))
+			continue;
+
+		entry = &memcpy_profile[src_target][dst_target][!!src_cached][!!dst_cached];
+		simaai_memcpy_set_entry(entry, mask);
+	}
+	pthread_mutex_unlock(&memcpy_profile_lock);
+
+	fclose(file);
+	return 0;
+}
+
+int simaai_memcpy_save_profile(const char *path)
+{
+	struct simaai_memcpy_profile *entry;
+	int src_target, dst_target, src_cached, dst_cached;
+	FILE *file;
 	int ret;
 
-	if ( ((dst_offset + size) > (dst->size))|| ((src_offset + size) > (src->size))) 
+	assert(path);
+
+	file = fopen(path, "w");
+	if (!file)
+		return -1;
+
+	fprintf(file, "# src_target dst_target src_cached dst_cached cpu_mask\n");
+
+	simaai_memory_lock(&memcpy_profile_lock);
+	for (src_target = 0; src_target < SIMAAI_MEM_NUM_TARGETS; src_target++)
+	for (dst_target = 0; dst_target < SIMAAI_MEM_NUM_TARGETS; dst_target++)
+	for (src_cached = 0; src_cached < 2; src_cached++)
+	for (dst_cached = 0; dst_cached < 2; dst_cached++) {
+		entry = &memcpy_profile[src_target][dst_target][src_cached][dst_cached];
+		if (__atomic_load_n(&entry->valid, __ATOMIC_ACQUIRE))
+			fprintf(file, "%d %d %d %d 0x%08x\n", src_target, dst_target,
+				src_cached, dst_cached, __atomic_load_n(&entry->cpu_mask, __ATOMIC_RELAXED));
+	}
+	pthread_mutex_unlock(&memcpy_profile_lock);
+
+	ret = ferror(file) ? -1 : 0;
+	if (fclose(file) != 0)
+		ret = -1;
+
+	return ret;
+}
+
+simaai_memory_t *simaai_memcpy_auto(simaai_memory_t *dst, uint64_t dst_offset,
+		simaai_memory_t *src, uint64_t src_offset, uint64_t size)
+{
+	int engine = SIMAAI_MEMCPY_ENGINE_DMA;
+
+	assert(dst);
+	assert(src);
+
+	if ((size > dst->size) || (dst_offset > dst->size - size) ||
+	    (size > src->size) || (src_offset > src->size - size)) {
+		errno = EINVAL;
 		return NULL;
+	}
 
-	if(fd < 0)
-		fd = open(SIMAAI_ALLOCATOR, O_RDWR | O_SYNC);
+	if (size == 0)
+		return dst;
 
-	if (fd < 0) {
+	/* The CPU can only copy between mapped buffers */
+	if (dst->vaddr && src->vaddr)
+		engine = simaai_memcpy_select(src->target, src->flags, dst->target,
+					      dst->flags, size, 1);
+
+	if (engine == SIMAAI_MEMCPY_ENGINE_CPU) {
+		simaai_memcpy_cpu(dst, dst_offset, src, src_offset, size);
+		return dst;
+	}
+
+	if (simaai_memcpy_dma(dst->phys_addr + dst_offset, src->phys_addr + src_offset, size) < 0)
+		return NULL;
+
+	return dst;
+}
+
+simaai_memory_t *simaai_memcpy_prio(simaai_memory_t *dst, uint64_t dst_offset,
+		simaai_memory_t *src, uint64_t src_offset, uint64_t size, int prio)
+{
+	simaai_memory_t *ret;
+	int prev = memcpy_thread_prio;
+
+	if ((prio < SIMAAI_MEMCPY_PRIO_HIGH) || (prio >= SIMAAI_MEMCPY_NUM_PRIOS)) {
+		errno = EINVAL;
 		return NULL;
 	}
 
-	memcpy_args.src_addr = src->phys_addr + src_offset;
-	memcpy_args.dst_addr = dst->phys_addr + dst_offset;
-	memcpy_args.size = size;
-	ret = ioctl(fd, SIMAAI_IOC_MEMCPY, &memcpy_args);
-	if (ret < 0) {
+	memcpy_thread_prio = prio;
+	ret = simaai_memcpy_auto(dst, dst_offset, src, src_offset, size);
+	memcpy_thread_prio = prev;
+
+	return ret;
+}
+
+/*
+ * Coherent copies. Maintenance before the copy is issued as one batch so
+ * that both sides share a single barrier.
+ */
+simaai_memory_t *simaai_memcpy_coherent(simaai_memory_t *dst, uint64_t dst_offset,
+		simaai_memory_t *src, uint64_t src_offset, uint64_t size)
+{
+	struct simaai_memory_cache_range ranges[2];
+	unsigned int count = 0;
+	int engine = SIMAAI_MEMCPY_ENGINE_DMA;
+
+	assert(dst);
+	assert(src);
+
+	if ((size > dst->size) || (dst_offset > dst->size - size) ||
+	    (size > src->size) || (src_offset > src->size - size)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (size == 0)
+		return dst;
+
+	if (dst->vaddr && src->vaddr)
+		engine = simaai_memcpy_select(src->target, src->flags, dst->target,
+					      dst->flags, size, 1);
+
+	/* The CPU copy leaves both sides coherent by itself */
+	if (engine == SIMAAI_MEMCPY_ENGINE_CPU) {
+		simaai_memcpy_cpu(dst, dst_offset, src, src_offset, size);
+		return dst;
+	}
+
+	if (src->flags & SIMAAI_MEM_FLAG_CACHED) {
+		ranges[count].memory = src;
+		ranges[count].offset = src_offset;
+		ranges[count].size = size;
+		ranges[count++].op = SIMAAI_MEM_CACHE_FLUSH;
+	}
+	/* Dirty destination lines must not be evicted over the copied data */
+	if (dst->flags & SIMAAI_MEM_FLAG_CACHED) {
+		ranges[count].memory = dst;
+		ranges[count].offset = dst_offset;
+		ranges[count].size = size;
+		ranges[count++].op = SIMAAI_MEM_CACHE_INVALIDATE;
+	}
+	simaai_memory_cache_ranges(ranges, count);
+
+	if (simaai_memcpy_dma(dst->phys_addr + dst_offset, src->phys_addr + src_offset, size) < 0)
+		return NULL;
+
+	/* Drop lines speculatively loaded while the copy was running */
+	if (dst->flags & SIMAAI_MEM_FLAG_CACHED)
+		simaai_memory_op_cache(dst, dst_offset, size, 'i');
+
+	return dst;
+}
+
+/*
+ * Strided copies.
+ *
+ * The layout is normalized before copying: dimensions of extent one are
+ * dropped, rows that are back to back on both sides are folded into the
+ * contiguous run, and adjacent outer dimensions that tile each other are
+ * merged. A fully contiguous rectangle therefore becomes one linear copy.
+ */
+struct simaai_memcpy_layout {
+	/* Number of outer dimensions */
+	unsigned int ndim;
+	uint64_t shape[SIMAAI_MEMCPY_MAX_DIMS];
+	uint64_t dst_stride[SIMAAI_MEMCPY_MAX_DIMS];
+	uint64_t src_stride[SIMAAI_MEMCPY_MAX_DIMS];
+	/* Contiguous bytes copied per row */
+	uint64_t run;
+};
+
+static int simaai_memcpy_layout_init(struct simaai_memcpy_layout *layout,
+		const uint64_t *dst_strides, const uint64_t *src_strides,
+		const uint64_t *shape, unsigned int ndim)
+{
+	unsigned int iter, n = 0;
+
+	layout->run = shape[ndim - 1];
+
+	for (iter = 0; iter + 1 < ndim; iter++) {
+		if (shape[iter] == 1)
+			continue;
+		layout->shape[n] = shape[iter];
+		layout->dst_stride[n] = dst_strides[iter];
+		layout->src_stride[n] = src_strides[iter];
+		n++;
+	}
+
+	/* Fold contiguous rows into the run */
+	while (n && (layout->dst_stride[n - 1] == layout->run) &&
+	       (layout->src_stride[n - 1] == layout->run)) {
+		if (__builtin_mul_overflow(layout->run, layout->shape[n - 1], &layout->run))
+			return -1;
+		n--;
+	}
+
+	/* Merge outer dimensions that tile each other on both sides */
+	for (iter = n - 1; n && iter > 0; iter--) {
+		uint64_t extent_dst, extent_src, rows;
+
+		if (__builtin_mul_overflow(layout->shape[iter], layout->dst_stride[iter], &extent_dst) ||
+		    __builtin_mul_overflow(layout->shape[iter], layout->src_stride[iter], &extent_src))
+			continue;
+		if ((layout->dst_stride[iter - 1] != extent_dst) ||
+		    (layout->src_stride[iter - 1] != extent_src))
+			continue;
+		/* Zero strides tile anything, the row count may not fit */
+		if (__builtin_mul_overflow(layout->shape[iter - 1], layout->shape[iter], &rows))
+			continue;
+
+		layout->shape[iter - 1] = rows;
+		layout->dst_stride[iter - 1] = layout->dst_stride[iter];
+		layout->src_stride[iter - 1] = layout->src_stride[iter];
+		memmove(&layout->shape[iter], &layout->shape[iter + 1], (n - iter - 1) * sizeof(uint64_t));
+		memmove(&layout->dst_stride[iter], &layout->dst_stride[iter + 1], (n - iter - 1) * sizeof(uint64_t));
+		memmove(&layout->src_stride[iter], &layout->src_stride[iter + 1], (n - iter - 1) * sizeof(uint64_t));
+		n--;
+	}
+
+	layout->ndim = n;
+	return 0;
+}
+
+/*
+ * Compute one past the last byte touched on one side of the copy,
+ * or fail if it does not fit into the buffer.
+ */
+static int simaai_memcpy_layout_end(const struct simaai_memcpy_layout *layout,
+		const uint64_t *strides, uint64_t offset, uint64_t buf_size, uint64_t *end)
+{
+	uint64_t span;
+	unsigned int iter;
+
+	if (__builtin_add_overflow(offset, layout->run, end))
+		return -1;
+
+	for (iter = 0; iter < layout->ndim; iter++) {
+		if (__builtin_mul_overflow(layout->shape[iter] - 1, strides[iter], &span) ||
+		    __builtin_add_overflow(*end, span, end))
+			return -1;
+	}
+
+	return (*end <= buf_size) ? 0 : -1;
+}
+
+simaai_memory_t *simaai_memcpy_nd(simaai_memory_t *dst, uint64_t dst_offset,
+		const uint64_t *dst_strides, simaai_memory_t *src, uint64_t src_offset,
+		const uint64_t *src_strides, const uint64_t *shape, unsigned int ndim)
+{
+	struct simaai_memcpy_layout layout;
+	uint64_t index[SIMAAI_MEMCPY_MAX_DIMS] = {0};
+	uint64_t dst_end, src_end, dst_pos, src_pos;
+	int engine = SIMAAI_MEMCPY_ENGINE_DMA;
+	unsigned int iter;
+	int level;
+
+	assert(dst);
+	assert(src);
+	assert(shape);
+
+	if ((ndim == 0) || (ndim > SIMAAI_MEMCPY_MAX_DIMS))
+		return NULL;
+
+	for (iter = 0; iter < ndim; iter++)
+		if (shape[iter] == 0)
+			return dst;
+
+	if ((ndim > 1) && (!dst_strides || !src_strides))
+		return NULL;
+
+	if (simaai_memcpy_layout_init(&layout, dst_strides, src_strides, shape, ndim) < 0)
 		return NULL;
+
+	if ((simaai_memcpy_layout_end(&layout, layout.dst_stride, dst_offset, dst->size, &dst_end) < 0) ||
+	    (simaai_memcpy_layout_end(&layout, layout.src_stride, src_offset, src->size, &src_end) < 0))
+		return NULL;
+
+	if (layout.ndim == 0)
+		return simaai_memcpy_auto(dst, dst_offset, src, src_offset, layout.run);
+
+	/* Every row has the same size, so one engine decision covers the copy */
+	if (dst->vaddr && src->vaddr)
+		engine = simaai_memcpy_select(src->target, src->flags, dst->target,
+					      dst->flags, layout.run, 1);
+
+	if (engine == SIMAAI_MEMCPY_ENGINE_CPU) {
+		/* Maintain the cache once over the whole extent instead of per row */
+		if (src->flags & SIMAAI_MEM_FLAG_CACHED)
+			simaai_memory_exec_op_civac((uint64_t)src->vaddr + src_offset, src_end - src_offset);
+		if (dst->flags & SIMAAI_MEM_FLAG_CACHED)
+			simaai_memory_exec_op_civac((uint64_t)dst->vaddr + dst_offset, dst_end - dst_offset);
+	}
+
+	dst_pos = dst_offset;
+	src_pos = src_offset;
+	for (;;) {
+		if (engine == SIMAAI_MEMCPY_ENGINE_CPU) {
+			memmove((char *)dst->vaddr + dst_pos, (const char *)src->vaddr + src_pos, layout.run);
+		} else if (simaai_memcpy_dma(dst->phys_addr + dst_pos, src->phys_addr + src_pos,
+					     layout.run) < 0) {
+			return NULL;
+		}
+
+		/* Advance the outer index, innermost dimension first */
+		for (level = layout.ndim - 1; level >= 0; level--) {
+			dst_pos += layout.dst_stride[level];
+			src_pos += layout.src_stride[level];
+			if (++index[level] < layout.shape[level])
+				break;
+			dst_pos -= layout.shape[level] * layout.dst_stride[level];
+			src_pos -= layout.shape[level] * layout.src_stride[level];
+			index[level] = 0;
+		}
+		if (level < 0)
+			break;
+	}
+
+	if ((engine == SIMAAI_MEMCPY_ENGINE_CPU) && (dst->flags & SIMAAI_MEM_FLAG_CACHED))
+		simaai_memory_exec_op_cvac((uint64_t)dst->vaddr + dst_offset, dst_end - dst_offset);
+
+	return dst;
+}
+
+simaai_memory_t *simaai_memcpy_2d(simaai_memory_t *dst, uint64_t dst_offset, uint64_t dst_pitch,
+		simaai_memory_t *src, uint64_t src_offset, uint64_t src_pitch,
+		uint64_t width, uint64_t height)
+{
+	uint64_t shape[2] = { height, width };
+
+	if ((height > 1) && ((dst_pitch < width) || (src_pitch < width)))
+		return NULL;
+
+	return simaai_memcpy_nd(dst, dst_offset, &dst_pitch, src, src_offset, &src_pitch, shape, 2);
+}
+
+/*
+ * Capacity and usage queries.
+ */
+static int simaai_memory_read_meminfo(const char *key, uint64_t *value)
+{
+	char line[128];
+	size_t key_len = strlen(key);
+	unsigned long long kb;
+	FILE *file;
+	int ret = -1;
+
+	file = fopen(SIMAAI_MEMINFO, "r");
+	if (!file)
+		return -1;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (strncmp(line, key, key_len) || (line[key_len] != ':'))
+			continue;
+		if (sscanf(line + key_len + 1, "%llu", &kb) == 1) {
+			*value = kb * 1024;
+			ret = 0;
+		}
+		break;
+	}
+
+	fclose(file);
+	return ret;
+}
+
+/* Allocate and immediately release a chunk without touching the registry */
+static int simaai_memory_try_alloc(uint64_t size, int target)
+{
+	struct simaai_alloc_args alloc_args = {0};
+	struct simaai_free_args free_args = {0};
+
+	alloc_args.num_of_segments = 1;
+	alloc_args.size[0] = size;
+	alloc_args.target = target;
+	if (simaai_memory_ioctl(fd, SIMAAI_IOC_MEM_ALLOC_COHERENT, &alloc_args) < 0)
+		return -1;
+
+	free_args.num_of_segments = 1;
+	free_args.phys_addr[0] = alloc_args.phys_addr[0];
+	simaai_memory_ioctl(fd, SIMAAI_IOC_MEM_FREE, &free_args);
+
+	return 0;
+}
+
+/*
+ * Binary search for the largest chunk the driver can currently hand out,
+ * with page granularity.
+ */
+static uint64_t simaai_memory_probe_largest(int target, uint64_t limit)
+{
+	struct simaai_alloc_args alloc_args = {0};
+	uint64_t lo = 0, hi, mid;
+
+	/* The driver cannot allocate more than its size field holds */
+	alloc_args.size[0] = ~alloc_args.size[0];
+	hi = alloc_args.size[0];
+	if (limit && (limit < hi))
+		hi = limit;
+	hi &= ~(uint64_t)(SIMAAI_PAGE_SIZE - 1);
+
+	if (hi && (simaai_memory_try_alloc(hi, target) == 0))
+		return hi;
+
+	while (hi - lo > SIMAAI_PAGE_SIZE) {
+		mid = (lo + (hi - lo) / 2) & ~(uint64_t)(SIMAAI_PAGE_SIZE - 1);
+		if (mid <= lo)
+			break;
+		if (simaai_memory_try_alloc(mid, target) == 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+int simaai_memory_query_target(int target, int query_flags,
+		struct simaai_memory_target_info *info)
+{
+	uint64_t value;
+
+	assert(info);
+
+	if ((target < 0) || (target >= SIMAAI_MEM_NUM_TARGETS)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(info, 0, sizeof(*info));
+
+	simaai_memory_lock(&registry_lock);
+	info->used = registry_usage[target].used;
+	info->live_allocations = registry_usage[target].live;
+	pthread_mutex_unlock(&registry_lock);
+
+	/* Only the generic target is backed by CMA the kernel reports on */
+	if (target == SIMAAI_MEM_TARGET_GENERIC) {
+		if (simaai_memory_read_meminfo("CmaTotal", &value) == 0) {
+			info->total = value;
+			info->valid |= SIMAAI_MEM_INFO_TOTAL;
+		}
+		if (simaai_memory_read_meminfo("CmaFree", &value) == 0) {
+			info->free = value;
+			info->valid |= SIMAAI_MEM_INFO_FREE;
+		}
+	}
+
+	if (query_flags & SIMAAI_MEM_QUERY_PROBE) {
+		if(fd < 0)
+			fd = simaai_memory_open();
+
+		if (fd < 0)
+			return -1;
+
+		info->largest_free = simaai_memory_probe_largest(target,
+				(info->valid & SIMAAI_MEM_INFO_FREE) ? info->free : 0);
+		info->valid |= SIMAAI_MEM_INFO_LARGEST_FREE;
+	}
+
+	if ((info->valid & SIMAAI_MEM_INFO_FREE) &&
+	    (info->valid & SIMAAI_MEM_INFO_LARGEST_FREE)) {
+		/* Both numbers are sampled at different times, clamp the ratio */
+		if (info->largest_free < info->free)
+			info->fragmentation = 1000 - (uint32_t)((info->largest_free * 1000) / info->free);
+		info->valid |= SIMAAI_MEM_INFO_FRAGMENTATION;
+	}
+
+	return 0;
+}
+
+size_t simaai_memory_snapshot(struct simaai_memory_alloc_info *entries, size_t max_entries)
+{
+	simaai_memory_t *memory;
+	size_t count = 0;
+
+	simaai_memory_lock(&registry_lock);
+	for (memory = registry_head; memory; memory = memory->reg_next, count++) {
+		if (!entries || (count >= max_entries))
+			continue;
+
+		entries[count].phys_addr = memory->phys_addr;
+		entries[count].bus_addr = memory->bus_addr;
+		entries[count].size = memory->size;
+		entries[count].target = memory->target;
+		entries[count].flags = memory->flags;
+		entries[count].kind = memory->kind;
+		entries[count].mapped = memory->vaddr != NULL;
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	return count;
+}
+
+/*
+ * Preallocation pools.
+ *
+ * Presets declare per target and size class how many chunks to reserve.
+ * Reserved chunks are allocated and mapped by a few worker threads at
+ * library load (SIMAAI_MEM_PRESETS) or on simaai_memory_warmup(). Later
+ * allocations that fit a class are served from the idle list without
+ * driver calls, and freeing them puts them back.
+ */
+#define SIMAAI_MEM_WARMUP_THREADS	(8)
+#define SIMAAI_MEM_PRESETS_MAX_FILE	(64 * 1024)
+/* Chunks a preset spec may reserve in total */
+#define SIMAAI_MEM_PRESETS_MAX_BUFFERS	(64 * 1024)
+
+struct simaai_memory_pool {
+	int target;
+	int flags;
+	/* Size class, every chunk of the pool has this size */
+	uint64_t size;
+	/* Pool no longer takes chunks back */
+	int released;
+	/* Idle chunks */
+	simaai_memory_t *idle_head;
+	struct simaai_memory_pool *next;
+};
+
+struct simaai_memory_warmup_job {
+	struct simaai_memory_pool *pool;
+	int ok;
+};
+
+struct simaai_memory_warmup_ctx {
+	struct simaai_memory_warmup_job *jobs;
+	unsigned int num_jobs;
+	unsigned int next_job;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct simaai_memory_pool *pool_head;
+static struct simaai_memory_warmup_stats warmup_totals;
+
+static simaai_memory_t *simaai_memory_pool_get(uint64_t size, int target, int flags)
+{
+	struct simaai_memory_pool *pool, *best = NULL;
+	simaai_memory_t *memory;
+	int zero = flags & SIMAAI_MEM_FLAG_ZERO;
+
+	if (!__atomic_load_n(&pool_head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	flags &= ~SIMAAI_MEM_LIBRARY_FLAGS;
+
+	simaai_memory_lock(&pool_lock);
+	for (pool = pool_head; pool; pool = pool->next) {
+		/* Do not hand out a class more than twice the request */
+		if (pool->released || !pool->idle_head || (pool->target != target) ||
+		    (pool->flags != flags) || (size > pool->size) || (size < pool->size / 2))
+			continue;
+		if (!best || (pool->size < best->size))
+			best = pool;
+	}
+
+	if (!best) {
+		pthread_mutex_unlock(&pool_lock);
+		return NULL;
+	}
+
+	memory = best->idle_head;
+	best->idle_head = memory->pool_next;
+	memory->pool_next = NULL;
+	memory->size = size;
+	pthread_mutex_unlock(&pool_lock);
+
+	simaai_memory_set_kind(memory, SIMAAI_MEM_KIND_POOLED);
+
+	/* A recycled chunk holds the previous user's data */
+	if (zero && (simaai_memory_clear(memory) < 0)) {
+		simaai_memory_free(memory);
+		return NULL;
+	}
+
+	return memory;
+}
+
+static int simaai_memory_pool_put(simaai_memory_t *memory)
+{
+	struct simaai_memory_pool *pool = memory->pool;
+
+	simaai_memory_lock(&pool_lock);
+	memory->size = memory->pool_size;
+	if (pool->released) {
+		pthread_mutex_unlock(&pool_lock);
+		return -1;
+	}
+
+	memory->vaddr = NULL;
+	memory->pool_next = pool->idle_head;
+	pool->idle_head = memory;
+	pthread_mutex_unlock(&pool_lock);
+
+	simaai_memory_set_kind(memory, SIMAAI_MEM_KIND_POOL);
+	return 0;
+}
+
+static struct simaai_memory_pool *simaai_memory_pool_find(int target, int flags, uint64_t size)
+{
+	struct simaai_memory_pool *pool;
+
+	simaai_memory_lock(&pool_lock);
+	for (pool = pool_head; pool; pool = pool->next)
+		if ((pool->target == target) && (pool->flags == flags) &&
+		    (pool->size == size) && !pool->released)
+			break;
+
+	if (!pool) {
+		pool = calloc(1, sizeof(*pool));
+		if (pool) {
+			pool->target = target;
+			pool->flags = flags;
+			pool->size = size;
+			pool->next = pool_head;
+			__atomic_store_n(&pool_head, pool, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	return pool;
+}
+
+static void *simaai_memory_warmup_worker(void *arg)
+{
+	struct simaai_memory_warmup_ctx *ctx = arg;
+	struct simaai_memory_warmup_job *job;
+	simaai_memory_t *memory;
+	unsigned int index;
+
+	for (;;) {
+		index = __atomic_fetch_add(&ctx->next_job, 1, __ATOMIC_RELAXED);
+		if (index >= ctx->num_jobs)
+			break;
+		job = &ctx->jobs[index];
+
+		memory = simaai_memory_alloc_chunk(job->pool->size, job->pool->target, job->pool->flags);
+		if (!memory)
+			continue;
+
+		if (!simaai_memory_map(memory)) {
+			simaai_memory_free(memory);
+			continue;
+		}
+
+		memory->pool = job->pool;
+		memory->pool_vaddr = memory->vaddr;
+		memory->pool_size = memory->size;
+		if (simaai_memory_pool_put(memory) < 0) {
+			memory->pool = NULL;
+			memory->pool_vaddr = NULL;
+			memory->pool_size = 0;
+			simaai_memory_free(memory);
+			continue;
+		}
+		job->ok = 1;
+	}
+
+	return NULL;
+}
+
+static uint64_t simaai_memory_parse_size(const char *str, char **end)
+{
+	uint64_t value = strtoull(str, end, 0);
+
+	switch (**end) {
+	case 'g': case 'G':
+		value <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		value <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		value <<= 10;
+		(*end)++;
+		break;
+	}
+
+	return value;
+}
+
+/*
+ * Turn "target:size:count[:flags]" entries separated by ';' or new lines
+ * into warmup jobs. Fields may also be separated by blanks, '#' starts a
+ * comment. The whole spec is checked before any pool is created.
+ */
+struct simaai_memory_preset {
+	int target;
+	int flags;
+	uint64_t size;
+	unsigned int count;
+};
+
+static int simaai_memory_parse_presets(char *spec, struct simaai_memory_warmup_ctx *ctx)
+{
+	struct simaai_memory_preset *presets = NULL, *grown;
+	struct simaai_memory_pool *pool;
+	char *entry, *save = NULL, *pos, *end;
+	unsigned int num = 0, total = 0, iter, index;
+	uint64_t size;
+	long target, count, flags;
+
+	for (entry = strtok_r(spec, ";\n", &save); entry; entry = strtok_r(NULL, ";\n", &save)) {
+		pos = strchr(entry, '#');
+		if (pos)
+			*pos = '\0';
+		for (pos = entry; *pos; pos++)
+			if (*pos == ':')
+				*pos = ' ';
+		pos = entry;
+		while (*pos == ' ' || *pos == '\t')
+			pos++;
+		if (*pos == '\0')
+			continue;
+
+		target = strtol(pos, &end, 0);
+		if ((end == pos) || (target < 0) || (target >= SIMAAI_MEM_NUM_TARGETS))
+			goto fail;
+		pos = end;
+		size = simaai_memory_parse_size(pos, &end);
+		if ((end == pos) || (size == 0))
+			goto fail;
+		pos = end;
+		count = strtol(pos, &end, 0);
+		if ((end == pos) || (count <= 0) || (count > SIMAAI_MEM_PRESETS_MAX_BUFFERS - total))
+			goto fail;
+		pos = end;
+		flags = strtol(pos, &end, 0);
+		if (end == pos)
+			flags = SIMAAI_MEM_FLAG_DEFAULT;
+		else if ((flags < 0) || (flags > INT_MAX))
+			goto fail;
+		pos = end;
+		while (*pos == ' ' || *pos == '\t' || *pos == '\r')
+			pos++;
+		if (*pos != '\0')
+			goto fail;
+
+		grown = realloc(presets, (num + 1) * sizeof(*presets));
+		if (!grown)
+			goto fail;
+		presets = grown;
+		presets[num].target = target;
+		presets[num].flags = flags;
+		presets[num].size = size;
+		presets[num].count = count;
+		num++;
+		total += count;
+	}
+
+	/* Nothing is reserved unless the whole spec is valid */
+	if (total) {
+		ctx->jobs = calloc(total, sizeof(*ctx->jobs));
+		if (!ctx->jobs)
+			goto fail;
+	}
+
+	for (index = 0; index < num; index++) {
+		pool = simaai_memory_pool_find(presets[index].target,
+					       presets[index].flags & ~SIMAAI_MEM_LIBRARY_FLAGS,
+					       presets[index].size);
+		if (!pool)
+			goto fail;
+
+		for (iter = 0; iter < presets[index].count; iter++)
+			ctx->jobs[ctx->num_jobs++].pool = pool;
+	}
+
+	free(presets);
+	return 0;
+
+fail:
+	free(presets);
+	free(ctx->jobs);
+	ctx->jobs = NULL;
+	ctx->num_jobs = 0;
+	return -1;
+}
+
+static char *simaai_memory_read_presets(const char *presets)
+{
+	char *spec;
+	FILE *file;
+	size_t len;
+
+	if (presets[0] != '@')
+		return strdup(presets);
+
+	file = fopen(presets + 1, "r");
+	if (!file)
+		return NULL;
+
+	spec = malloc(SIMAAI_MEM_PRESETS_MAX_FILE + 1);
+	if (spec) {
+		len = fread(spec, 1, SIMAAI_MEM_PRESETS_MAX_FILE, file);
+		spec[len] = '\0';
+	}
+
+	fclose(file);
+	return spec;
+}
+
+int simaai_memory_warmup(const char *presets, struct simaai_memory_warmup_stats *stats)
+{
+	struct simaai_memory_warmup_ctx ctx = {0};
+	struct simaai_memory_warmup_stats result = {0};
+	pthread_t threads[SIMAAI_MEM_WARMUP_THREADS];
+	unsigned int num_threads, iter;
+	uint64_t start;
+	char *spec;
+	int ret = 0;
+
+	if (!presets)
+		presets = getenv("SIMAAI_MEM_PRESETS");
+	if (!presets)
+		return 0;
+
+	start = simaai_memory_time_ns();
+
+	spec = simaai_memory_read_presets(presets);
+	if (!spec)
+		return -1;
+
+	ret = simaai_memory_parse_presets(spec, &ctx);
+	free(spec);
+	if (ret < 0) {
+		if (stats)
+			*stats = result;
+		return -1;
+	}
+
+	num_threads = (ctx.num_jobs < SIMAAI_MEM_WARMUP_THREADS) ? ctx.num_jobs : SIMAAI_MEM_WARMUP_THREADS;
+	for (iter = 0; iter < num_threads; iter++)
+		if (pthread_create(&threads[iter], NULL, simaai_memory_warmup_worker, &ctx) != 0)
+			break;
+	num_threads = iter;
+
+	/* Run the jobs here if no thread could be started */
+	if (num_threads == 0)
+		simaai_memory_warmup_worker(&ctx);
+
+	for (iter = 0; iter < num_threads; iter++)
+		pthread_join(threads[iter], NULL);
+
+	for (iter = 0; iter < ctx.num_jobs; iter++) {
+		if (ctx.jobs[iter].ok) {
+			result.buffers++;
+			result.bytes += ctx.jobs[iter].pool->size;
+		} else {
+			result.failed++;
+			ret = -1;
+		}
+	}
+	free(ctx.jobs);
+
+	result.elapsed_ns = simaai_memory_time_ns() - start;
+
+	simaai_memory_lock(&pool_lock);
+	warmup_totals.elapsed_ns += result.elapsed_ns;
+	warmup_totals.bytes += result.bytes;
+	warmup_totals.buffers += result.buffers;
+	warmup_totals.failed += result.failed;
+	pthread_mutex_unlock(&pool_lock);
+
+	if (stats)
+		*stats = result;
+
+	return ret;
+}
+
+void simaai_memory_get_warmup_stats(struct simaai_memory_warmup_stats *stats)
+{
+	assert(stats);
+
+	simaai_memory_lock(&pool_lock);
+	*stats = warmup_totals;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void simaai_memory_release_presets(void)
+{
+	struct simaai_memory_pool *pool;
+	simaai_memory_t *idle = NULL, *memory;
+
+	simaai_memory_lock(&pool_lock);
+	for (pool = pool_head; pool; pool = pool->next) {
+		pool->released = 1;
+		while (pool->idle_head) {
+			memory = pool->idle_head;
+			pool->idle_head = memory->pool_next;
+			memory->pool_next = idle;
+			idle = memory;
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	while (idle) {
+		memory = idle;
+		idle = memory->pool_next;
+		simaai_memory_free(memory);
+	}
+}
+
+static void __attribute__((constructor)) simaai_memory_init(void)
+{
+	struct simaai_memory_warmup_stats stats = {0};
+	const char *value = getenv("SIMAAI_MEM_LOCK_STATS");
+	int ret;
+
+	if (value && (strcmp(value, "0") != 0))
+		simaai_memory_set_lock_stats(1);
+
+	if (!getenv("SIMAAI_MEM_PRESETS"))
+		return;
+
+	ret = simaai_memory_warmup(NULL, &stats);
+
+	if (getenv("SIMAAI_MEM_PRESETS_REPORT"))
+		fprintf(stderr, "simaai-mem: preallocated %u buffers (%llu bytes) in %.3f ms%s\n",
+			stats.buffers, (unsigned long long)stats.bytes,
+			stats.elapsed_ns / 1e6, (ret < 0) ? ", some presets failed" : "");
+}
+
+/*
+ * Streaming file I/O.
+ *
+ * The file range is split into large chunks that a few threads read
+ * straight into (or write straight from) the buffer mapping. Each thread
+ * does the cache maintenance of its own chunk right after or before the
+ * I/O, so it overlaps with the other threads' transfers.
+ */
+#define SIMAAI_MEM_IO_THREADS		(4)
+#define SIMAAI_MEM_IO_MAX_THREADS	(16)
+#define SIMAAI_MEM_IO_CHUNK		(4 * 1024 * 1024)
+#define SIMAAI_MEM_IO_ALIGN		(4096)
+
+struct simaai_memory_io_ctx {
+	simaai_memory_t *memory;
+	/* Buffer address the file range starts at */
+	char *vaddr;
+	uint64_t file_offset;
+	uint64_t size;
+	int store;
+	/* Descriptor for O_DIRECT transfers, -1 if not used */
+	int direct_fd;
+	int buffered_fd;
+	uint64_t next_chunk;
+	uint64_t num_chunks;
+	/* First errno seen by any worker */
+	int error;
+};
+
+static int simaai_memory_io_env(const char *name, int def, int max)
+{
+	const char *value = getenv(name);
+	long parsed;
+
+	if (!value)
+		return def;
+
+	parsed = strtol(value, NULL, 0);
+	if ((parsed <= 0) || (parsed > max))
+		return def;
+
+	return parsed;
+}
+
+static int simaai_memory_io_range(int fd, char *vaddr, uint64_t file_offset,
+		uint64_t size, int store)
+{
+	ssize_t done;
+
+	while (size) {
+		if (store)
+			done = pwrite(fd, vaddr, size, file_offset);
+		else
+			done = pread(fd, vaddr, size, file_offset);
+
+		if (done < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		/* Reading past the end of file */
+		if (done == 0)
+			return -EIO;
+
+		vaddr += done;
+		file_offset += done;
+		size -= done;
+	}
+
+	return 0;
+}
+
+static int simaai_memory_io_chunk(struct simaai_memory_io_ctx *ctx, uint64_t pos, uint64_t len)
+{
+	char *vaddr = ctx->vaddr + pos;
+	uint64_t file_offset = ctx->file_offset + pos;
+	uint64_t direct_len = 0;
+	int fd, ret;
+
+	fd = __atomic_load_n(&ctx->direct_fd, __ATOMIC_RELAXED);
+	if ((fd >= 0) && !((uint64_t)vaddr % SIMAAI_MEM_IO_ALIGN) &&
+	    !(file_offset % SIMAAI_MEM_IO_ALIGN))
+		direct_len = len & ~(uint64_t)(SIMAAI_MEM_IO_ALIGN - 1);
+
+	if (direct_len) {
+		ret = simaai_memory_io_range(fd, vaddr, file_offset, direct_len, ctx->store);
+		/* Device mappings may refuse direct I/O, stay buffered from now on */
+		if ((ret == -EFAULT) || (ret == -EINVAL)) {
+			__atomic_store_n(&ctx->direct_fd, -1, __ATOMIC_RELAXED);
+			direct_len = 0;
+		} else if (ret < 0) {
+			return ret;
+		}
+	}
+
+	if (len > direct_len) {
+		ret = simaai_memory_io_range(ctx->buffered_fd, vaddr + direct_len,
+					     file_offset + direct_len, len - direct_len, ctx->store);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void *simaai_memory_io_worker(void *arg)
+{
+	struct simaai_memory_io_ctx *ctx = arg;
+	uint64_t index, pos, len;
+	int cached = ctx->memory->flags & SIMAAI_MEM_FLAG_CACHED;
+	int ret;
+
+	for (;;) {
+		if (__atomic_load_n(&ctx->error, __ATOMIC_RELAXED))
+			break;
+
+		index = __atomic_fetch_add(&ctx->next_chunk, 1, __ATOMIC_RELAXED);
+		if (index >= ctx->num_chunks)
+			break;
+
+		pos = index * SIMAAI_MEM_IO_CHUNK;
+		len = ctx->size - pos;
+		if (len > SIMAAI_MEM_IO_CHUNK)
+			len = SIMAAI_MEM_IO_CHUNK;
+
+		/* Written by the devices, drop stale lines before reading them */
+		if (ctx->store && cached)
+			simaai_memory_exec_op_civac((uint64_t)ctx->vaddr + pos, len);
+
+		ret = simaai_memory_io_chunk(ctx, pos, len);
+		if (ret < 0) {
+			__atomic_compare_exchange_n(&ctx->error, &(int){0}, -ret, 0,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			break;
+		}
+
+		/* Make the chunk visible to the devices */
+		if (!ctx->store && cached)
+			simaai_memory_exec_op_cvac((uint64_t)ctx->vaddr + pos, len);
+	}
+
+	return NULL;
+}
+
+static int simaai_memory_file_io(simaai_memory_t *memory, uint64_t offset, const char *path,
+		uint64_t file_offset, uint64_t size, int io_flags,
+		struct simaai_memory_io_stats *stats, int store)
+{
+	struct simaai_memory_io_ctx ctx = {0};
+	pthread_t threads[SIMAAI_MEM_IO_MAX_THREADS];
+	unsigned int num_threads, iter;
+	int open_flags = store ? (O_WRONLY | O_CREAT | ((io_flags & SIMAAI_MEM_IO_TRUNC) ? O_TRUNC : 0)) :
+			     O_RDONLY;
+	int direct_fd = -1;
+	int mapped_here = 0;
+	uint64_t start;
+	struct stat st;
+
+	assert(memory);
+	assert(path);
+
+	if (offset > memory->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	start = simaai_memory_time_ns();
+
+	ctx.memory = memory;
+	ctx.store = store;
+	ctx.direct_fd = -1;
+	ctx.buffered_fd = open(path, open_flags | O_CLOEXEC, 0644);
+	if (ctx.buffered_fd < 0)
+		return -1;
+
+	if (size == 0) {
+		size = memory->size - offset;
+		if (!store) {
+			if (fstat(ctx.buffered_fd, &st) < 0)
+				goto err;
+			size = ((uint64_t)st.st_size > file_offset) ? st.st_size - file_offset : 0;
+		}
+	}
+
+	if (size > memory->size - offset) {
+		errno = EINVAL;
+		goto err;
+	}
+
+	if (!memory->vaddr) {
+		if (!simaai_memory_map(memory))
+			goto err;
+		mapped_here = 1;
+	}
+
+	ctx.vaddr = (char *)memory->vaddr + offset;
+	ctx.file_offset = file_offset;
+	ctx.size = size;
+	ctx.num_chunks = (size + SIMAAI_MEM_IO_CHUNK - 1) / SIMAAI_MEM_IO_CHUNK;
+
+	if (io_flags & SIMAAI_MEM_IO_DIRECT) {
+		direct_fd = open(path, (store ? O_WRONLY : O_RDONLY) | O_DIRECT | O_CLOEXEC);
+		ctx.direct_fd = direct_fd;
+	}
+
+	if (!store) {
+		posix_fadvise(ctx.buffered_fd, file_offset, size, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(ctx.buffered_fd, file_offset, size, POSIX_FADV_WILLNEED);
+	}
+
+	num_threads = simaai_memory_io_env("SIMAAI_MEM_IO_THREADS", SIMAAI_MEM_IO_THREADS,
+					   SIMAAI_MEM_IO_MAX_THREADS);
+	if (num_threads > ctx.num_chunks)
+		num_threads = ctx.num_chunks;
+
+	for (iter = 0; iter < num_threads; iter++)
+		if (pthread_create(&threads[iter], NULL, simaai_memory_io_worker, &ctx) != 0)
+			break;
+	num_threads = iter;
+
+	if (num_threads == 0)
+		simaai_memory_io_worker(&ctx);
+
+	for (iter = 0; iter < num_threads; iter++)
+		pthread_join(threads[iter], NULL);
+
+	if (direct_fd >= 0)
+		close(direct_fd);
+	if (mapped_here)
+		simaai_memory_unmap(memory);
+	if (close(ctx.buffered_fd) < 0 && !ctx.error)
+		ctx.error = errno;
+
+	if (ctx.error) {
+		errno = ctx.error;
+		return -1;
+	}
+
+	if (stats) {
+		stats->bytes = size;
+		stats->elapsed_ns = simaai_memory_time_ns() - start;
+		stats->gbps = stats->elapsed_ns ? (double)size / stats->elapsed_ns : 0.0;
+	}
+
+	return 0;
+err:
+	if (mapped_here)
+		simaai_memory_unmap(memory);
+	close(ctx.buffered_fd);
+	return -1;
+}
+
+int simaai_memory_load_file(simaai_memory_t *memory, uint64_t offset, const char *path,
+		uint64_t file_offset, uint64_t size, int io_flags,
+		struct simaai_memory_io_stats *stats)
+{
+	return simaai_memory_file_io(memory, offset, path, file_offset, size, io_flags, stats, 0);
+}
+
+int simaai_memory_store_file(simaai_memory_t *memory, uint64_t offset, const char *path,
+		uint64_t file_offset, uint64_t size, int io_flags,
+		struct simaai_memory_io_stats *stats)
+{
+	return simaai_memory_file_io(memory, offset, path, file_offset, size, io_flags, stats, 1);
+}
+
+/*
+ * Zero initialization.
+ *
+ * Small chunks, cached chunks and chunks that are already mapped are
+ * cleared with stores through the mapping, followed by a clean when the
+ * mapping is cached. Large uncached chunks are cleared by driver copies
+ * from a zero filled chunk, which keeps the CPU off slow uncached stores.
+ * The memcpy dispatcher profile decides where the boundary lies. The zero
+ * chunk belongs to the library, it is kept out of the registry and freed
+ * when the library is unloaded.
+ */
+#define SIMAAI_MEM_ZERO_CHUNK	(1024 * 1024)
+
+static pthread_once_t zero_once = PTHREAD_ONCE_INIT;
+static simaai_memory_t *zero_chunk;
+
+static void simaai_memory_zero_chunk_init(void)
+{
+	simaai_memory_t *memory;
+
+	memory = simaai_memory_alloc_chunk(SIMAAI_MEM_ZERO_CHUNK, SIMAAI_MEM_TARGET_GENERIC,
+					   SIMAAI_MEM_FLAG_DEFAULT);
+	if (!memory)
+		return;
+
+	if (!simaai_memory_map(memory)) {
+		simaai_memory_free(memory);
+		return;
+	}
+
+	memset(memory->vaddr, 0, memory->size);
+	simaai_memory_unmap(memory);
+	simaai_memory_unregister(memory);
+	zero_chunk = memory;
+}
+
+static void __attribute__((destructor)) simaai_memory_zero_chunk_exit(void)
+{
+	struct simaai_free_args free_args = {0};
+
+	if (!zero_chunk || (fd < 0))
+		return;
+
+	free_args.num_of_segments = 1;
+	free_args.phys_addr[0] = zero_chunk->phys_addr;
+	simaai_memory_ioctl(fd, SIMAAI_IOC_MEM_FREE, &free_args);
+	free(zero_chunk);
+	zero_chunk = NULL;
+}
+
+static int simaai_memory_clear_dma(simaai_memory_t *memory)
+{
+	uint64_t pos, len;
+
+	pthread_once(&zero_once, simaai_memory_zero_chunk_init);
+	if (!zero_chunk)
+		return -1;
+
+	for (pos = 0; pos < memory->size; pos += len) {
+		len = memory->size - pos;
+		if (len > zero_chunk->size)
+			len = zero_chunk->size;
+		if (simaai_memcpy_dma(memory->phys_addr + pos, zero_chunk->phys_addr, len) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int simaai_memory_clear(simaai_memory_t *memory)
+{
+	int cached = memory->flags & SIMAAI_MEM_FLAG_CACHED;
+	void *vaddr = memory->vaddr ? memory->vaddr : memory->pool_vaddr;
+	int mapped_here = 0;
+
+	if (!vaddr && !cached &&
+	    (simaai_memcpy_get_engine(SIMAAI_MEM_TARGET_GENERIC, SIMAAI_MEM_FLAG_DEFAULT,
+				      memory->target, memory->flags, memory->size) == SIMAAI_MEMCPY_ENGINE_DMA) &&
+	    (simaai_memory_clear_dma(memory) == 0))
+		return 0;
+
+	if (!vaddr) {
+		vaddr = simaai_memory_map(memory);
+		if (!vaddr)
+			return -1;
+		mapped_here = 1;
+	}
+
+	memset(vaddr, 0, memory->size);
+	if (cached)
+		simaai_memory_exec_op_cvac((uint64_t)vaddr, memory->size);
+
+	if (mapped_here)
+		simaai_memory_unmap(memory);
+
+	return 0;
+}
+
+/*
+ * Deferred free.
+ *
+ * When enabled, simaai_memory_free() pushes the chunk onto a lock-free
+ * list and returns. A background thread takes the whole list at once,
+ * unmaps the chunks and releases them with as few SIMAAI_IOC_MEM_FREE
+ * calls as possible, up to MAX_SEGMENTS chunks per call.
+ *
+ * Every list taken off the queue is numbered and tracked until it is
+ * released, so simaai_memory_drain_frees() waits only for the lists taken
+ * before its own and not for chunks queued while it waits.
+ */
+struct simaai_memory_defer_batch {
+	/* Order in which the list was taken off the queue */
+	uint64_t seq;
+	struct simaai_memory_defer_batch *next;
+};
+
+static pthread_once_t defer_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t defer_lock = PTHREAD_MUTEX_INITIALIZER;
+static simaai_memory_t *defer_head;
+static sem_t defer_sem;
+static int defer_enabled;
+static int defer_thread_running;
+static int defer_stop;
+static pthread_t defer_thread;
+/* Chunks queued or being released */
+static uint64_t defer_pending;
+/* Lists being released, protected by defer_batch_lock */
+static pthread_mutex_t defer_batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defer_batch_cond = PTHREAD_COND_INITIALIZER;
+static struct simaai_memory_defer_batch *defer_batches;
+static uint64_t defer_seq;
+
+static void simaai_memory_release_list(simaai_memory_t *list)
+{
+	struct simaai_free_args free_args = {0};
+	simaai_memory_t *batch[MAX_SEGMENTS];
+	simaai_memory_t *memory;
+	unsigned int iter;
+
+	while (list) {
+		free_args.num_of_segments = 0;
+
+		while (list && (free_args.num_of_segments < MAX_SEGMENTS)) {
+			memory = list;
+			list = memory->defer_next;
+
+			if (memory->pool_vaddr)
+				memory->vaddr = memory->pool_vaddr;
+			if (memory->vaddr)
+				munmap(memory->vaddr - memory->offset,
+				       simaai_memory_chunk_size(memory) + memory->offset);
+
+			batch[free_args.num_of_segments] = memory;
+			free_args.phys_addr[free_args.num_of_segments++] = memory->phys_addr;
+		}
+
+		simaai_memory_ioctl(fd, SIMAAI_IOC_MEM_FREE, &free_args);
+
+		for (iter = 0; iter < free_args.num_of_segments; iter++) {
+			simaai_memory_unregister(batch[iter]);
+			free(batch[iter]);
+		}
+		__atomic_sub_fetch(&defer_pending, free_args.num_of_segments, __ATOMIC_RELEASE);
+	}
+}
+
+/* Take the queued chunks and release them as one numbered batch */
+static void simaai_memory_release_queued(struct simaai_memory_defer_batch *batch)
+{
+	struct simaai_memory_defer_batch **iter;
+	simaai_memory_t *list;
+
+	simaai_memory_lock(&defer_batch_lock);
+	list = __atomic_exchange_n(&defer_head, NULL, __ATOMIC_ACQUIRE);
+	batch->seq = ++defer_seq;
+	batch->next = defer_batches;
+	defer_batches = batch;
+	pthread_mutex_unlock(&defer_batch_lock);
+
+	simaai_memory_release_list(list);
+
+	simaai_memory_lock(&defer_batch_lock);
+	for (iter = &defer_batches; *iter != batch; iter = &(*iter)->next)
+		;
+	*iter = batch->next;
+	pthread_cond_broadcast(&defer_batch_cond);
+	pthread_mutex_unlock(&defer_batch_lock);
+}
+
+static void *simaai_memory_defer_worker(void *arg)
+{
+	struct simaai_memory_defer_batch batch;
+
+	(void)arg;
+
+	while (!__atomic_load_n(&defer_stop, __ATOMIC_ACQUIRE)) {
+		while (sem_wait(&defer_sem) < 0)
+			;
+
+		simaai_memory_release_queued(&batch);
+	}
+
+	return NULL;
+}
+
+/* Called with defer_lock held */
+static int simaai_memory_defer_start(void)
+{
+	if (defer_thread_running)
+		return 0;
+
+	if (pthread_create(&defer_thread, NULL, simaai_memory_defer_worker, NULL) != 0)
+		return -1;
+
+	defer_thread_running = 1;
+	return 0;
+}
+
+/*
+ * The worker does not exist in a forked child and the locks may have been
+ * held by it, frees of the child are synchronous until deferred free is
+ * enabled again. Chunks already queued are released by the next drain.
+ */
+static void simaai_memory_defer_atfork_child(void)
+{
+	pthread_mutex_init(&defer_lock, NULL);
+	pthread_mutex_init(&defer_batch_lock, NULL);
+	pthread_cond_init(&defer_batch_cond, NULL);
+	defer_batches = NULL;
+	defer_thread_running = 0;
+	__atomic_store_n(&defer_enabled, 0, __ATOMIC_RELEASE);
+}
+
+/* Stop the worker and release what is still queued when the library unloads */
+static void __attribute__((destructor)) simaai_memory_defer_exit(void)
+{
+	if (!defer_thread_running)
+		return;
+
+	__atomic_store_n(&defer_enabled, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&defer_stop, 1, __ATOMIC_RELEASE);
+	sem_post(&defer_sem);
+	pthread_join(defer_thread, NULL);
+	defer_thread_running = 0;
+
+	simaai_memory_drain_frees();
+}
+
+static void simaai_memory_defer_init(void)
+{
+	const char *value = getenv("SIMAAI_MEM_DEFERRED_FREE");
+
+	sem_init(&defer_sem, 0, 0);
+	pthread_atfork(NULL, NULL, simaai_memory_defer_atfork_child);
+
+	if (!value || (strcmp(value, "0") == 0))
+		return;
+
+	simaai_memory_lock(&defer_lock);
+	if (simaai_memory_defer_start() == 0)
+		__atomic_store_n(&defer_enabled, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&defer_lock);
+}
+
+static int simaai_memory_defer_free(simaai_memory_t *memory)
+{
+	simaai_memory_t *head;
+
+	pthread_once(&defer_once, simaai_memory_defer_init);
+
+	if (!__atomic_load_n(&defer_enabled, __ATOMIC_ACQUIRE))
+		return -1;
+
+	/* Only chunks the driver frees by physical address */
+	if ((memory->kind != SIMAAI_MEM_KIND_ALLOC) && (memory->kind != SIMAAI_MEM_KIND_ATTACH) &&
+	    (memory->kind != SIMAAI_MEM_KIND_POOLED) && (memory->kind != SIMAAI_MEM_KIND_POOL))
+		return -1;
+
+	if(fd < 0)
+		return -1;
+
+	__atomic_add_fetch(&defer_pending, 1, __ATOMIC_RELAXED);
+
+	head = __atomic_load_n(&defer_head, __ATOMIC_RELAXED);
+	do {
+		memory->defer_next = head;
+	} while (!__atomic_compare_exchange_n(&defer_head, &head, memory, 1,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	sem_post(&defer_sem);
+	return 0;
+}
+
+int simaai_memory_set_deferred_free(int enable)
+{
+	int ret = 0;
+
+	pthread_once(&defer_once, simaai_memory_defer_init);
+
+	simaai_memory_lock(&defer_lock);
+	if (enable)
+		ret = simaai_memory_defer_start();
+	if (ret == 0)
+		__atomic_store_n(&defer_enabled, !!enable, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&defer_lock);
+
+	if (!enable)
+		simaai_memory_drain_frees();
+
+	return ret;
+}
+
+/* Called with defer_batch_lock held */
+static int simaai_memory_defer_older(uint64_t seq)
+{
+	struct simaai_memory_defer_batch *iter;
+
+	for (iter = defer_batches; iter; iter = iter->next)
+		if (iter->seq < seq)
+			return 1;
+
+	return 0;
+}
+
+void simaai_memory_drain_frees(void)
+{
+	struct simaai_memory_defer_batch batch;
+
+	simaai_memory_release_queued(&batch);
+
+	/* Wait for the batches taken before this one */
+	simaai_memory_lock(&defer_batch_lock);
+	while (simaai_memory_defer_older(batch.seq))
+		pthread_cond_wait(&defer_batch_cond, &defer_batch_lock);
+	pthread_mutex_unlock(&defer_batch_lock);
+}
+
+static int simaai_memory_reclaim(void)
+{
+	if (!__atomic_load_n(&defer_pending, __ATOMIC_ACQUIRE))
+		return 0;
+
+	simaai_memory_drain_frees();
+	return 1;
+}
+
+/*
+ * Batched cache maintenance.
+ *
+ * Ranges of any number of buffers are turned into cache line aligned
+ * virtual address intervals, sorted and merged, and every line is
+ * maintained once. One barrier completes the whole batch. Where a flush
+ * and an invalidate overlap the merged interval is cleaned and
+ * invalidated, which is a superset of both.
+ */
+#define SIMAAI_MEM_CACHE_BATCH_STACK	(64)
+
+struct simaai_memory_cache_interval {
+	uint64_t start;
+	uint64_t end;
+	int op;
+};
+
+static int simaai_memory_interval_cmp(const void *a, const void *b)
+{
+	const struct simaai_memory_cache_interval *left = a, *right = b;
+
+	if (left->start != right->start)
+		return (left->start < right->start) ? -1 : 1;
+
+	return 0;
+}
+
+void simaai_memory_cache_ranges(const struct simaai_memory_cache_range *ranges, unsigned int count)
+{
+	struct simaai_memory_cache_interval stack[SIMAAI_MEM_CACHE_BATCH_STACK];
+	struct simaai_memory_cache_interval *intervals = stack, *cur;
+	const struct simaai_memory_cache_range *range;
+	uint64_t offset, size;
+	unsigned int iter, num = 0;
+	int invalidate = 0;
+
+	if (!count)
+		return;
+
+	assert(ranges);
+
+	if (count > SIMAAI_MEM_CACHE_BATCH_STACK) {
+		intervals = malloc(count * sizeof(*intervals));
+		/* Fall back to one barrier per range */
+		if (!intervals) {
+			for (iter = 0; iter < count; iter++)
+				simaai_memory_op_cache(ranges[iter].memory, ranges[iter].offset,
+						       ranges[iter].size,
+						       (ranges[iter].op == SIMAAI_MEM_CACHE_INVALIDATE) ? 'i' : 'c');
+			return;
+		}
+	}
+
+	for (iter = 0; iter < count; iter++) {
+		range = &ranges[iter];
+		assert(range->memory);
+
+		/* Same clipping as simaai_memory_flush_cache_part64() */
+		if (!range->memory->vaddr || (range->offset >= range->memory->size))
+			continue;
+		offset = range->offset;
+		size = range->size;
+		if ((size == 0) || (size > range->memory->size - offset))
+			size = range->memory->size - offset;
+
+		cur = &intervals[num++];
+		cur->start = ((uint64_t)range->memory->vaddr + offset) & ~(uint64_t)(SIMAAI_CACHE_LINE_SIZE - 1);
+		cur->end = (uint64_t)range->memory->vaddr + offset + size;
+		cur->op = range->op;
+	}
+
+	if (num > 1)
+		qsort(intervals, num, sizeof(*intervals), simaai_memory_interval_cmp);
+
+	cur = NULL;
+	for (iter = 0; iter < num; iter++) {
+		/* Extend the current interval with overlapping or touching ranges of the same kind */
+		if (cur && ((intervals[iter].start < cur->end) ||
+			    ((intervals[iter].start <= cur->end) && (intervals[iter].op == cur->op)))) {
+			if (intervals[iter].end > cur->end)
+				cur->end = intervals[iter].end;
+			if (intervals[iter].op == SIMAAI_MEM_CACHE_INVALIDATE) {
+				cur->op = SIMAAI_MEM_CACHE_INVALIDATE;
+				invalidate = 1;
+			}
+			continue;
+		}
+
+		if (cur) {
+			if (cur->op == SIMAAI_MEM_CACHE_INVALIDATE)
+				simaai_memory_lines_civac(cur->start, cur->end);
+			else
+				simaai_memory_lines_cvac(cur->start, cur->end);
+		}
+		cur = &intervals[iter];
+		invalidate |= cur->op == SIMAAI_MEM_CACHE_INVALIDATE;
+	}
+
+	if (cur) {
+		if (cur->op == SIMAAI_MEM_CACHE_INVALIDATE)
+			simaai_memory_lines_civac(cur->start, cur->end);
+		else
+			simaai_memory_lines_cvac(cur->start, cur->end);
+		simaai_memory_barrier(invalidate);
+	}
+
+	if (intervals != stack)
+		free(intervals);
+}
+
+/*
+ * Bump arenas.
+ *
+ * An arena owns one mapped chunk and hands out sub-chunks by moving a top
+ * offset. Handles are kept in blocks that survive resets, so steady state
+ * allocation touches neither malloc nor the driver. A mark is the number
+ * of handles in use, each handle remembers the top before it was carved.
+ */
+#define SIMAAI_MEM_ARENA_BLOCK	(64)
+
+struct simaai_memory_arena_handle {
+	/* Must be first, handed out to the user */
+	simaai_memory_t memory;
+	/* Arena top before this handle was allocated */
+	uint64_t top;
+};
+
+struct simaai_memory_arena {
+	/* Backing chunk, mapped for the arena lifetime */
+	simaai_memory_t *memory;
+	/* Allocation flags, including library flags */
+	int flags;
+	/* Kind of the backing chunk before it was taken by the arena */
+	int kind;
+	/* Bytes in use from the start of the chunk */
+	uint64_t top;
+	/* Handles in use */
+	uint64_t count;
+	/* Handle blocks of SIMAAI_MEM_ARENA_BLOCK entries */
+	struct simaai_memory_arena_handle **blocks;
+	uint64_t num_blocks;
+};
+
+simaai_memory_arena_t *simaai_memory_arena_create(uint64_t size, int target, int flags)
+{
+	simaai_memory_arena_t *arena;
+
+	if (size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	arena = calloc(1, sizeof(*arena));
+	if (!arena)
+		return NULL;
+
+	arena->flags = flags;
+	arena->memory = simaai_memory_alloc_flags64(size, target, flags & ~SIMAAI_MEM_LIBRARY_FLAGS);
+	if (!arena->memory) {
+		free(arena);
+		return NULL;
+	}
+
+	if (!simaai_memory_map(arena->memory)) {
+		simaai_memory_free(arena->memory);
+		free(arena);
+		return NULL;
+	}
+
+	arena->kind = arena->memory->kind;
+	simaai_memory_set_kind(arena->memory, SIMAAI_MEM_KIND_ARENA);
+
+	return arena;
+}
+
+/*
+ * Check that no buffer handed out since the mark is still used by slices,
+ * their handles are about to be reused or freed.
+ */
+static int simaai_memory_arena_busy(simaai_memory_arena_t *arena, uint64_t mark)
+{
+	struct simaai_memory_arena_handle *handle;
+	uint64_t iter;
+
+	for (iter = mark; iter < arena->count; iter++) {
+		handle = &arena->blocks[iter / SIMAAI_MEM_ARENA_BLOCK][iter % SIMAAI_MEM_ARENA_BLOCK];
+		if (__atomic_load_n(&handle->memory.refs, __ATOMIC_ACQUIRE) & ~SIMAAI_MEM_REFS_RELEASED)
+			return 1;
+	}
+
+	return 0;
+}
+
+int simaai_memory_arena_destroy(simaai_memory_arena_t *arena)
+{
+	uint64_t iter;
+
+	assert(arena);
+
+	if (simaai_memory_arena_busy(arena, 0)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	simaai_memory_set_kind(arena->memory, arena->kind);
+	simaai_memory_unmap(arena->memory);
+	simaai_memory_free(arena->memory);
+
+	for (iter = 0; iter < arena->num_blocks; iter++)
+		free(arena->blocks[iter]);
+	free(arena->blocks);
+	free(arena);
+
+	return 0;
+}
+
+static struct simaai_memory_arena_handle *simaai_memory_arena_handle(simaai_memory_arena_t *arena,
+		uint64_t index)
+{
+	struct simaai_memory_arena_handle **blocks;
+	uint64_t block = index / SIMAAI_MEM_ARENA_BLOCK;
+
+	if (block >= arena->num_blocks) {
+		blocks = realloc(arena->blocks, (arena->num_blocks + 1) * sizeof(*blocks));
+		if (!blocks)
+			return NULL;
+		arena->blocks = blocks;
+
+		blocks[arena->num_blocks] = calloc(SIMAAI_MEM_ARENA_BLOCK, sizeof(**blocks));
+		if (!blocks[arena->num_blocks])
+			return NULL;
+		arena->num_blocks++;
+	}
+
+	return &arena->blocks[block][index % SIMAAI_MEM_ARENA_BLOCK];
+}
+
+simaai_memory_t *simaai_memory_arena_alloc(simaai_memory_arena_t *arena, uint64_t size, uint64_t align)
+{
+	struct simaai_memory_arena_handle *handle;
+	simaai_memory_t *parent;
+	uint64_t start, end;
+
+	assert(arena);
+	parent = arena->memory;
+
+	if (align == 0)
+		align = SIMAAI_CACHE_LINE_SIZE;
+
+	if ((size == 0) || (align & (align - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* Align the physical address, the chunk itself may be less aligned */
+	start = ((parent->phys_addr + arena->top + align - 1) & ~(align - 1)) - parent->phys_addr;
+	if ((start < arena->top) || (start > parent->size) || (size > parent->size - start)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	end = start + size;
+
+	handle = simaai_memory_arena_handle(arena, arena->count);
+	if (!handle)
+		return NULL;
+
+	memset(&handle->memory, 0, sizeof(handle->memory));
+	handle->memory.vaddr = parent->vaddr + start;
+	handle->memory.size = size;
+	handle->memory.phys_addr = parent->phys_addr + start;
+	handle->memory.bus_addr = parent->bus_addr + start;
+	handle->memory.target = parent->target;
+	handle->memory.offset = parent->offset + start;
+	handle->memory.flags = parent->flags;
+	handle->memory.kind = SIMAAI_MEM_KIND_ARENA;
+	handle->memory.parent = parent;
+	handle->top = arena->top;
+
+	if ((arena->flags & SIMAAI_MEM_FLAG_ZERO) && (simaai_memory_clear(&handle->memory) < 0))
+		return NULL;
+
+	arena->top = end;
+	arena->count++;
+
+	return &handle->memory;
+}
+
+uint64_t simaai_memory_arena_mark(simaai_memory_arena_t *arena)
+{
+	assert(arena);
+
+	return arena->count;
+}
+
+int simaai_memory_arena_reset(simaai_memory_arena_t *arena, uint64_t mark)
+{
+	assert(arena);
+
+	if (mark >= arena->count)
+		return 0;
+
+	if (simaai_memory_arena_busy(arena, mark)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	arena->top = simaai_memory_arena_handle(arena, mark)->top;
+	arena->count = mark;
+
+	return 0;
+}
+
+uint64_t simaai_memory_arena_get_used(simaai_memory_arena_t *arena)
+{
+	assert(arena);
+
+	return arena->top;
+}
+
+simaai_memory_t *simaai_memory_arena_get_memory(simaai_memory_arena_t *arena)
+{
+	assert(arena);
+
+	return arena->memory;
+}
+
+/*
+ * Per-thread arenas, one per target, destroyed by the key destructor when
+ * the thread exits.
+ */
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+static int arena_key_valid;
+
+static void simaai_memory_arena_thread_exit(void *arg)
+{
+	simaai_memory_arena_t **arenas = arg;
+	unsigned int iter;
+
+	/* Arenas still used by slices are left to the process exit */
+	for (iter = 0; iter < SIMAAI_MEM_NUM_TARGETS; iter++) {
+		if (arenas[iter])
+			simaai_memory_arena_destroy(arenas[iter]);
+	}
+	free(arenas);
+}
+
+static void simaai_memory_arena_key_init(void)
+{
+	arena_key_valid = (pthread_key_create(&arena_key, simaai_memory_arena_thread_exit) == 0);
+}
+
+simaai_memory_arena_t *simaai_memory_arena_thread(uint64_t size, int target, int flags)
+{
+	simaai_memory_arena_t **arenas;
+
+	if ((target < 0) || (target >= SIMAAI_MEM_NUM_TARGETS)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pthread_once(&arena_once, simaai_memory_arena_key_init);
+	if (!arena_key_valid)
+		return NULL;
+
+	arenas = pthread_getspecific(arena_key);
+	if (!arenas) {
+		arenas = calloc(SIMAAI_MEM_NUM_TARGETS, sizeof(*arenas));
+		if (!arenas)
+			return NULL;
+		if (pthread_setspecific(arena_key, arenas) != 0) {
+			free(arenas);
+			return NULL;
+		}
+	}
+
+	if (!arenas[target])
+		arenas[target] = simaai_memory_arena_create(size, target, flags);
+
+	return arenas[target];
+}
+
+/*
+ * Large copies.
+ *
+ * The range is cut into chunks whose boundaries are aligned in the
+ * destination, and a pool of threads takes chunks in order. Each chunk
+ * goes to the engine the dispatcher picks for the target pair, so several
+ * driver copies can be in flight at once or the CPUs can share the work.
+ * Workers inherit the priority class of the caller.
+ */
+#define SIMAAI_MEMCPY_LARGE_CHUNK	(4 * 1024 * 1024)
+#define SIMAAI_MEMCPY_LARGE_THREADS	(4)
+#define SIMAAI_MEMCPY_LARGE_MAX_THREADS	(16)
+
+struct simaai_memcpy_large_ctx {
+	simaai_memory_t *dst;
+	simaai_memory_t *src;
+	uint64_t dst_offset;
+	uint64_t src_offset;
+	uint64_t size;
+	/* Length of the first chunk, the rest start on chunk boundaries */
+	uint64_t head;
+	uint64_t next_chunk;
+	uint64_t num_chunks;
+	int engine;
+	int prio;
+	simaai_memcpy_progress_t progress;
+	void *arg;
+	pthread_mutex_t progress_lock;
+	uint64_t done;
+	int cancelled;
+	/* First errno seen by any worker */
+	int error;
+};
+
+static void *simaai_memcpy_large_worker(void *arg)
+{
+	struct simaai_memcpy_large_ctx *ctx = arg;
+	uint64_t index, pos, len, done;
+	int ret = 0;
+
+	memcpy_thread_prio = ctx->prio;
+
+	for (;;) {
+		if (__atomic_load_n(&ctx->error, __ATOMIC_RELAXED) ||
+		    __atomic_load_n(&ctx->cancelled, __ATOMIC_RELAXED))
+			break;
+
+		index = __atomic_fetch_add(&ctx->next_chunk, 1, __ATOMIC_RELAXED);
+		if (index >= ctx->num_chunks)
+			break;
+
+		pos = index ? ctx->head + (index - 1) * SIMAAI_MEMCPY_LARGE_CHUNK : 0;
+		len = index ? SIMAAI_MEMCPY_LARGE_CHUNK : ctx->head;
+		if (len > ctx->size - pos)
+			len = ctx->size - pos;
+
+		if (ctx->engine == SIMAAI_MEMCPY_ENGINE_CPU)
+			simaai_memcpy_cpu(ctx->dst, ctx->dst_offset + pos,
+					  ctx->src, ctx->src_offset + pos, len);
+		else
+			ret = simaai_memcpy_dma(ctx->dst->phys_addr + ctx->dst_offset + pos,
+						ctx->src->phys_addr + ctx->src_offset + pos, len);
+		if (ret < 0) {
+			__atomic_compare_exchange_n(&ctx->error, &(int){0}, errno ? errno : EIO, 0,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			break;
+		}
+
+		if (!ctx->progress)
+			continue;
+
+		/* Reports are serialized so that progress never goes backwards */
+		simaai_memory_lock(&ctx->progress_lock);
+		done = (ctx->done += len);
+		if (!__atomic_load_n(&ctx->cancelled, __ATOMIC_RELAXED) &&
+		    ctx->progress(done, ctx->size, ctx->arg))
+			__atomic_store_n(&ctx->cancelled, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&ctx->progress_lock);
+	}
+
+	return NULL;
+}
+
+simaai_memory_t *simaai_memcpy_large(simaai_memory_t *dst, uint64_t dst_offset,
+		simaai_memory_t *src, uint64_t src_offset, uint64_t size,
+		simaai_memcpy_progress_t progress, void *arg,
+		struct simaai_memory_io_stats *stats)
+{
+	struct simaai_memcpy_large_ctx ctx = {0};
+	pthread_t threads[SIMAAI_MEMCPY_LARGE_MAX_THREADS];
+	unsigned int num_threads, iter;
+	uint64_t start, dst_addr, src_addr;
+
+	assert(dst);
+	assert(src);
+
+	if ((size > dst->size) || (dst_offset > dst->size - size) ||
+	    (size > src->size) || (src_offset > src->size - size)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* Chunks run in any order, overlapping ranges would be corrupted */
+	dst_addr = dst->phys_addr + dst_offset;
+	src_addr = src->phys_addr + src_offset;
+	if (size && (dst_addr < src_addr + size) && (src_addr < dst_addr + size)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	start = simaai_memory_time_ns();
+
+	ctx.dst = dst;
+	ctx.src = src;
+	ctx.dst_offset = dst_offset;
+	ctx.src_offset = src_offset;
+	ctx.size = size;
+	ctx.prio = memcpy_thread_prio;
+	ctx.progress = progress;
+	ctx.arg = arg;
+	pthread_mutex_init(&ctx.progress_lock, NULL);
+
+	ctx.head = SIMAAI_MEMCPY_LARGE_CHUNK - (dst_addr % SIMAAI_MEMCPY_LARGE_CHUNK);
+	if (ctx.head > size)
+		ctx.head = size;
+	if (size)
+		ctx.num_chunks = 1 + (size - ctx.head + SIMAAI_MEMCPY_LARGE_CHUNK - 1) /
+				     SIMAAI_MEMCPY_LARGE_CHUNK;
+
+	ctx.engine = SIMAAI_MEMCPY_ENGINE_DMA;
+	if (dst->vaddr && src->vaddr && size)
+		ctx.engine = simaai_memcpy_select(src->target, src->flags, dst->target, dst->flags,
+						  (size < SIMAAI_MEMCPY_LARGE_CHUNK) ? size :
+						  SIMAAI_MEMCPY_LARGE_CHUNK, 1);
+
+	num_threads = simaai_memory_io_env("SIMAAI_MEMCPY_THREADS", SIMAAI_MEMCPY_LARGE_THREADS,
+					   SIMAAI_MEMCPY_LARGE_MAX_THREADS);
+	if (num_threads > ctx.num_chunks)
+		num_threads = ctx.num_chunks;
+
+	/* The caller works as well */
+	for (iter = 0; iter + 1 < num_threads; iter++)
+		if (pthread_create(&threads[iter], NULL, simaai_memcpy_large_worker, &ctx) != 0)
+			break;
+	num_threads = iter;
+
+	simaai_memcpy_large_worker(&ctx);
+
+	for (iter = 0; iter < num_threads; iter++)
+		pthread_join(threads[iter], NULL);
+
+	pthread_mutex_destroy(&ctx.progress_lock);
+
+	if (ctx.error) {
+		errno = ctx.error;
+		return NULL;
+	}
+
+	if (ctx.cancelled) {
+		errno = ECANCELED;
+		return NULL;
+	}
+
+	if (stats) {
+		stats->bytes = size;
+		stats->elapsed_ns = simaai_memory_time_ns() - start;
+		stats->gbps = stats->elapsed_ns ? (double)size / stats->elapsed_ns : 0.0;
 	}
 
 	return dst;
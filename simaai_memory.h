@@ -18,6 +18,7 @@ extern "C"
  * Memory chunk context.
  */
 typedef struct simaai_memory_t simaai_memory_t;
+typedef struct simaai_memory_arena simaai_memory_arena_t;
 
 /*
  * Memory type to allocate.
@@ -40,6 +41,170 @@ typedef struct simaai_memory_t simaai_memory_t;
 #define SIMAAI_MEM_FLAG_CACHED	(1 << 0)
 #define SIMAAI_MEM_FLAG_RDONLY	(1 << 1)
 #define SIMAAI_MEM_FLAG_DEFAULT	(0x0)
+/* Library flags, handled in user space and not passed to the driver */
+#define SIMAAI_MEM_FLAG_ZERO	(1 << 8) /* zero fill on allocation */
+#define SIMAAI_MEM_FLAG_SHARED_MAP	(1 << 9) /* segments share one mapping */
+
+/*
+ * How a memory chunk was obtained, as reported by simaai_memory_snapshot().
+ */
+#define SIMAAI_MEM_KIND_ALLOC		(0) /* simaai_memory_alloc*() */
+#define SIMAAI_MEM_KIND_SEGMENT		(1) /* simaai_memory_alloc_segments*() */
+#define SIMAAI_MEM_KIND_ATTACH		(2) /* simaai_memory_attach() */
+#define SIMAAI_MEM_KIND_POOL		(3) /* idle preallocated chunk */
+#define SIMAAI_MEM_KIND_POOLED		(4) /* preallocated chunk in use */
+#define SIMAAI_MEM_KIND_ARENA		(5) /* chunk backing a simaai_memory_arena_t */
+#define SIMAAI_MEM_KIND_SLICE		(6) /* simaai_memory_slice() */
+
+/*
+ * Fields of struct simaai_memory_target_info that hold a value.
+ */
+#define SIMAAI_MEM_INFO_TOTAL		(1 << 0)
+#define SIMAAI_MEM_INFO_FREE		(1 << 1)
+#define SIMAAI_MEM_INFO_LARGEST_FREE	(1 << 2)
+#define SIMAAI_MEM_INFO_FRAGMENTATION	(1 << 3)
+
+/*
+ * simaai_memory_query_target() flags.
+ */
+#define SIMAAI_MEM_QUERY_PROBE		(1 << 0) /* find the largest free block */
+
+/*
+ * Capacity and usage of one memory target.
+ * used and live_allocations are always valid and count the chunks held by
+ * this process. The remaining fields are system wide and only hold a value
+ * when the matching SIMAAI_MEM_INFO_* bit is set in valid.
+ */
+struct simaai_memory_target_info {
+	/* Total target capacity in bytes */
+	uint64_t total;
+	/* Bytes held by this process */
+	uint64_t used;
+	/* Free bytes on the target */
+	uint64_t free;
+	/* Largest chunk that can currently be allocated */
+	uint64_t largest_free;
+	/* Number of chunks held by this process */
+	uint32_t live_allocations;
+	/* 0 (one free block) to 1000 (free space fully scattered) */
+	uint32_t fragmentation;
+	/* SIMAAI_MEM_INFO_* bits */
+	uint32_t valid;
+};
+
+/*
+ * One live memory chunk of this process.
+ */
+struct simaai_memory_alloc_info {
+	uint64_t phys_addr;
+	uint64_t bus_addr;
+	uint64_t size;
+	uint32_t target;
+	int flags;
+	/* SIMAAI_MEM_KIND_* */
+	int kind;
+	/* Non zero if the chunk is currently mapped */
+	int mapped;
+};
+
+/*
+ * Result of preallocating preset pools.
+ */
+struct simaai_memory_warmup_stats {
+	/* Wall time spent allocating and mapping */
+	uint64_t elapsed_ns;
+	/* Bytes reserved */
+	uint64_t bytes;
+	/* Chunks reserved */
+	uint32_t buffers;
+	/* Chunks that could not be allocated or mapped */
+	uint32_t failed;
+};
+
+/*
+ * simaai_memory_load_file() and simaai_memory_store_file() flags.
+ */
+#define SIMAAI_MEM_IO_DIRECT		(1 << 0) /* bypass the page cache where possible */
+#define SIMAAI_MEM_IO_TRUNC		(1 << 1) /* store: truncate the file first */
+
+/*
+ * Result of a file transfer.
+ */
+struct simaai_memory_io_stats {
+	/* Bytes transferred */
+	uint64_t bytes;
+	/* Wall time of the transfer including cache maintenance */
+	uint64_t elapsed_ns;
+	/* Achieved bandwidth in GB/s */
+	double gbps;
+};
+
+/*
+ * Contention of the library internal locks.
+ */
+struct simaai_memory_lock_stats {
+	/* Lock acquisitions */
+	uint64_t acquisitions;
+	/* Acquisitions that had to wait for another thread */
+	uint64_t contended;
+	/* Total time spent waiting */
+	uint64_t wait_ns;
+};
+
+/*
+ * Copy engines selected by the memcpy dispatcher.
+ */
+#define SIMAAI_MEMCPY_ENGINE_DMA	(0) /* SIMAAI_IOC_MEMCPY driver copy */
+#define SIMAAI_MEMCPY_ENGINE_CPU	(1) /* copy through the mappings */
+
+/*
+ * Memcpy priority classes, lower values are served first.
+ */
+#define SIMAAI_MEMCPY_PRIO_HIGH		(0) /* latency critical, never split */
+#define SIMAAI_MEMCPY_PRIO_NORMAL	(1) /* default */
+#define SIMAAI_MEMCPY_PRIO_LOW		(2) /* bulk transfers */
+
+/*
+ * Latency of the driver copies of one priority class.
+ */
+struct simaai_memcpy_qos_stats {
+	/* Completed copies */
+	uint64_t count;
+	/* Copied bytes */
+	uint64_t bytes;
+	/* Latency from submission to completion, including waiting */
+	uint64_t avg_ns;
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+	uint64_t max_ns;
+	/* Times a copy of this class waited for a higher class */
+	uint64_t preemptions;
+};
+
+/*
+ * Maximum number of dimensions of a strided copy.
+ */
+#define SIMAAI_MEMCPY_MAX_DIMS		(8)
+
+/*
+ * Cache operations of a batched cache maintenance range.
+ */
+#define SIMAAI_MEM_CACHE_FLUSH		(0) /* write back dirty lines */
+#define SIMAAI_MEM_CACHE_INVALIDATE	(1) /* write back and invalidate lines */
+
+/*
+ * One range of a batched cache maintenance request.
+ */
+struct simaai_memory_cache_range {
+	/* Buffer the range belongs to */
+	simaai_memory_t *memory;
+	/* Range offset inside the buffer */
+	uint64_t offset;
+	/* Range size, clipped to the buffer, 0 means up to the end */
+	uint64_t size;
+	/* SIMAAI_MEM_CACHE_FLUSH or SIMAAI_MEM_CACHE_INVALIDATE */
+	int op;
+};
 
 /**
  * @brief Allocate contiguous memory chunk of given size with default flags:
@@ -63,6 +228,31 @@ simaai_memory_t *simaai_memory_alloc(unsigned int size, int target);
  */
 simaai_memory_t *simaai_memory_alloc_flags(unsigned int size, int target, int flags);
 
+/**
+ * @brief Allocate contiguous memory chunk of given 64 bit size with default
+ *        flags: non-cachable, writable
+ *
+ * @param size Memory chunk size.
+ * @param target Target memory type to allocate.
+ * @return Allocated memory chunk context that can later be successfully
+ *         passed to simaai_memory_* functions or NULL in case of failure.
+ *         Fails with EINVAL for sizes the driver cannot represent.
+ */
+simaai_memory_t *simaai_memory_alloc64(uint64_t size, int target);
+
+/**
+ * @brief Allocate contiguous memory chunk of given 64 bit size with
+ *        specific flags.
+ *
+ * @param size Memory chunk size.
+ * @param target Target memory type to allocate.
+ * @param flags Memory flags (cacheable, writable, etc).
+ * @return Allocated memory chunk context that can later be successfully
+ *         passed to simaai_memory_* functions or NULL in case of failure.
+ *         Fails with EINVAL for sizes the driver cannot represent.
+ */
+simaai_memory_t *simaai_memory_alloc_flags64(uint64_t size, int target, int flags);
+
 
 /**
  * @brief Allocate contiguous memory chunk of given sizes with default flags:
@@ -92,6 +282,21 @@ simaai_memory_t **simaai_memory_alloc_segments(uint32_t *segments,
 simaai_memory_t **simaai_memory_alloc_segments_flags(uint32_t *segments,
        uint32_t num_of_segments, int target, int flags);
 
+/**
+ * @brief Allocate contiguous memory chunk of given 64 bit sizes with
+ *        specific flags
+ *
+ * @param segments array of different segment size to be allocated
+ * @param num_of_segments size of the segment_size array
+ * @param target Target memory type to allocate.
+ * @param flags Memory flags (cacheable, writable, etc).
+ * @return array of simaai_memory_t pointer, with size of the array equal to num_of_segments
+               or NULL in case of failure. Fails with EINVAL for sizes the
+               driver cannot represent.
+ */
+simaai_memory_t **simaai_memory_alloc_segments_flags64(const uint64_t *segments,
+       uint32_t num_of_segments, int target, int flags);
+
 /**
  * @brief Attach to the previously allocated memory chunk by physical address.
  *
@@ -101,6 +306,23 @@ simaai_memory_t **simaai_memory_alloc_segments_flags(uint32_t *segments,
  */
 simaai_memory_t *simaai_memory_attach(uint64_t phys_addr);
 
+/**
+ * @brief Create a view of a part of a memory chunk without a driver call.
+ *        The slice has its own physical, bus and virtual address and can be
+ *        passed to all simaai_memory_* functions. It shares the mapping of
+ *        the parent, mapping the slice maps the parent if needed. The parent
+ *        stays mapped and alive until all its slices are freed with
+ *        simaai_memory_free(), simaai_memory_unmap() of the parent keeps the
+ *        mapping and simaai_memory_free() of the parent completes when the
+ *        last slice is freed.
+ *
+ * @param parent The memory chunk context, may itself be a slice.
+ * @param offset Slice offset inside the parent.
+ * @param size Slice size.
+ * @return Slice context or NULL in case of failure.
+ */
+simaai_memory_t *simaai_memory_slice(simaai_memory_t *parent, uint64_t offset, uint64_t size);
+
 /**
  * @brief Free the previously allocated memory chunk.
  *
@@ -109,8 +331,117 @@ simaai_memory_t *simaai_memory_attach(uint64_t phys_addr);
  */
 void simaai_memory_free(simaai_memory_t *memory);
 
+/**
+ * @brief Enable or disable deferred free.
+ *        When enabled, simaai_memory_free() only queues the chunk and a
+ *        background thread unmaps and releases queued chunks in batches.
+ *        Allocations that fail while frees are pending drain the queue and
+ *        retry once. Can also be enabled with SIMAAI_MEM_DEFERRED_FREE=1.
+ *        Disabling drains the queue, and so does unloading the library. A
+ *        forked child frees synchronously until it enables deferred free.
+ *
+ * @param enable Non zero to enable deferred free.
+ * @return 0 on success, -1 if the background thread could not be started.
+ */
+int simaai_memory_set_deferred_free(int enable);
+
+/**
+ * @brief Release all chunks queued for a deferred free before the call.
+ *        Use at shutdown or when memory runs low.
+ *
+ * @return None.
+ */
+void simaai_memory_drain_frees(void);
+
+/**
+ * @brief Create a bump arena backed by one contiguous, mapped memory chunk.
+ *        Buffers allocated from the arena are released together by
+ *        simaai_memory_arena_reset() or simaai_memory_arena_destroy().
+ *        An arena must not be used by several threads at once, see
+ *        simaai_memory_arena_thread().
+ *
+ * @param size Arena size in bytes.
+ * @param target Target memory type to allocate.
+ * @param flags Allocation flags, with SIMAAI_MEM_FLAG_ZERO every arena
+ *        buffer is zero filled when it is handed out.
+ * @return Arena or NULL in case of failure.
+ */
+simaai_memory_arena_t *simaai_memory_arena_create(uint64_t size, int target, int flags);
+
+/**
+ * @brief Destroy an arena and free its memory chunk. Buffers allocated from
+ *        the arena become invalid.
+ *
+ * @param arena The arena.
+ * @return 0 on success, -1 with errno EBUSY if a buffer of the arena still
+ *         has slices, the arena is left unchanged.
+ */
+int simaai_memory_arena_destroy(simaai_memory_arena_t *arena);
+
+/**
+ * @brief Allocate a buffer from an arena without a system call.
+ *        The buffer is mapped, has its own physical and bus address and can
+ *        be passed to all simaai_memory_* functions. simaai_memory_free()
+ *        on it does nothing, the memory returns to the arena on reset.
+ *
+ * @param arena The arena.
+ * @param size Buffer size.
+ * @param align Power of two alignment of the physical address, 0 selects
+ *        the cache line size so that buffers never share a cache line.
+ * @return Buffer or NULL if the arena is exhausted.
+ */
+simaai_memory_t *simaai_memory_arena_alloc(simaai_memory_arena_t *arena, uint64_t size, uint64_t align);
+
+/**
+ * @brief Get the current arena position, to be passed to
+ *        simaai_memory_arena_reset() later.
+ *
+ * @param arena The arena.
+ * @return Arena position.
+ */
+uint64_t simaai_memory_arena_mark(simaai_memory_arena_t *arena);
+
+/**
+ * @brief Release all buffers allocated from an arena since the given mark.
+ *        The handles of released buffers are reused by later allocations.
+ *
+ * @param arena The arena.
+ * @param mark Position from simaai_memory_arena_mark(), 0 releases all.
+ * @return 0 on success, -1 with errno EBUSY if a buffer to be released
+ *         still has slices, the arena is left unchanged.
+ */
+int simaai_memory_arena_reset(simaai_memory_arena_t *arena, uint64_t mark);
+
+/**
+ * @brief Get the number of bytes in use in an arena, including alignment.
+ *
+ * @param arena The arena.
+ * @return Bytes in use.
+ */
+uint64_t simaai_memory_arena_get_used(simaai_memory_arena_t *arena);
+
+/**
+ * @brief Get the memory chunk backing an arena.
+ *
+ * @param arena The arena.
+ * @return The memory chunk, owned by the arena.
+ */
+simaai_memory_t *simaai_memory_arena_get_memory(simaai_memory_arena_t *arena);
+
+/**
+ * @brief Get the calling thread's arena for a target, creating it on first
+ *        use. The arena is destroyed when the thread exits.
+ *
+ * @param size Arena size, only used when the arena is created.
+ * @param target Target memory type.
+ * @param flags Allocation flags, only used when the arena is created.
+ * @return Arena or NULL in case of failure.
+ */
+simaai_memory_arena_t *simaai_memory_arena_thread(uint64_t size, int target, int flags);
+
 /**
  * @brief Free the previously allocated memory segments.
+ *        Segments that still have slices are freed with their last slice.
  *
  * @param segments array of segments to be freed
  * @param num_of_segments size of the segment array
@@ -127,8 +458,22 @@ void simaai_memory_free_segments(simaai_memory_t **segments, unsigned int num_of
  */
 void *simaai_memory_map(simaai_memory_t *memory);
 
+/**
+ * @brief Map all segments of a multi-segment allocation.
+ *        Segments allocated with SIMAAI_MEM_FLAG_SHARED_MAP share a single
+ *        mapping of their parent chunk, created by the first segment that
+ *        is mapped and removed when the last one is unmapped or freed.
+ *
+ * @param segments Array of segments from simaai_memory_alloc_segments*().
+ * @param num_of_segments Size of the segment array.
+ * @return 0 on success, -1 if any segment could not be mapped, in which
+ *         case no segment is left mapped by this call.
+ */
+int simaai_memory_map_segments(simaai_memory_t **segments, unsigned int num_of_segments);
+
 /**
  * @brief Unmap the previously allocated and mapped memory chunk.
+ *        The mapping of a chunk that has slices is kept.
  *
  * @param memory The memory chunk context.
  * @return None.
@@ -196,6 +541,17 @@ void simaai_memory_flush_cache(simaai_memory_t *memory);
  */
 void simaai_memory_flush_cache_part(simaai_memory_t *memory, unsigned int offset, unsigned int size);
 
+/**
+ * @brief Flush cache of a 64 bit addressed part of the allocated memory chunk.
+ *        The range is clipped to the buffer, size 0 means up to the end.
+ *
+ * @param memory The memory chunk context.
+ * @param offset Memory chunk offset inside the buffer to flush.
+ * @param size Memory chunk size to flush.
+ * @return None.
+ */
+void simaai_memory_flush_cache_part64(simaai_memory_t *memory, uint64_t offset, uint64_t size);
+
 /**
  * @brief Invalidate cache of the allocated memory chunk.
  *        Should be called before the first read from the application cores.
@@ -216,6 +572,150 @@ void simaai_memory_invalidate_cache(simaai_memory_t *memory);
  */
 void simaai_memory_invalidate_cache_part(simaai_memory_t *memory, unsigned int offset, unsigned int size);
 
+/**
+ * @brief Invalidate cache of a 64 bit addressed part of the allocated memory
+ *        chunk. The range is clipped to the buffer, size 0 means up to the end.
+ *
+ * @param memory The memory chunk context.
+ * @param offset Memory chunk offset inside the buffer to invalidate.
+ * @param size Memory chunk size to invalidate.
+ * @return None.
+ */
+void simaai_memory_invalidate_cache_part64(simaai_memory_t *memory, uint64_t offset, uint64_t size);
+
+/**
+ * @brief Flush and invalidate cache of several ranges at once.
+ *        Ranges may belong to different buffers and may overlap, each cache
+ *        line is maintained once and a single barrier completes the batch.
+ *        Overlapping flush and invalidate ranges are both written back and
+ *        invalidated. Buffers without a CPU mapping are skipped.
+ *
+ * @param ranges Ranges to maintain.
+ * @param count Number of ranges.
+ * @return None.
+ */
+void simaai_memory_cache_ranges(const struct simaai_memory_cache_range *ranges, unsigned int count);
+
+
+/**
+ * @brief Preallocate and map pools of memory chunks in parallel.
+ *        Later allocations with the same target and flags whose size is
+ *        within a pool size class (and at least half of it) are served from
+ *        the pool without driver calls, and return to it when freed.
+ *        Pooled chunks report the requested size.
+ *        Presets are "target:size:count[:flags]" entries separated by ';'
+ *        or new lines, size may have a k, M or G suffix, at most 65536
+ *        chunks are reserved in total. A value starting
+ *        with '@' names a file holding the entries.
+ *        The library runs this at load time when SIMAAI_MEM_PRESETS is set
+ *        and prints the startup time when SIMAAI_MEM_PRESETS_REPORT is set.
+ *
+ * @param presets Preset entries, or NULL to use SIMAAI_MEM_PRESETS.
+ * @param stats Filled with the result of this call, may be NULL.
+ * @return 0 on success, -1 if any preset could not be reserved, or if the
+ *         presets could not be parsed, in which case none is reserved.
+ */
+int simaai_memory_warmup(const char *presets, struct simaai_memory_warmup_stats *stats);
+
+/**
+ * @brief Get the accumulated result of all warmups, including the one run
+ *        at library load.
+ *
+ * @param stats Filled with the accumulated result.
+ * @return None.
+ */
+void simaai_memory_get_warmup_stats(struct simaai_memory_warmup_stats *stats);
+
+/**
+ * @brief Free all idle preallocated chunks and stop pooling. Chunks that
+ *        are in use are freed normally when the application frees them.
+ *
+ * @return None.
+ */
+void simaai_memory_release_presets(void);
+
+/**
+ * @brief Read a file range straight into the memory chunk.
+ *        The range is read in large chunks by parallel threads
+ *        (SIMAAI_MEM_IO_THREADS, default 4) with kernel readahead enabled.
+ *        Cached chunks are flushed piece by piece while other pieces are
+ *        still being read. An unmapped chunk is mapped for the transfer.
+ *
+ * @param memory The memory chunk context.
+ * @param offset Offset inside the buffer to load to.
+ * @param path File to read.
+ * @param file_offset Offset inside the file to read from.
+ * @param size Bytes to read, 0 for the rest of the file.
+ * @param io_flags SIMAAI_MEM_IO_* flags.
+ * @param stats Filled with the transfer result, may be NULL.
+ * @return 0 on success, -1 with errno set in case of failure.
+ */
+int simaai_memory_load_file(simaai_memory_t *memory, uint64_t offset, const char *path,
+       uint64_t file_offset, uint64_t size, int io_flags,
+       struct simaai_memory_io_stats *stats);
+
+/**
+ * @brief Write a part of the memory chunk straight to a file.
+ *        Counterpart of simaai_memory_load_file(), cached pieces are
+ *        invalidated before they are written. The file is created if needed
+ *        and only truncated with SIMAAI_MEM_IO_TRUNC, otherwise bytes
+ *        outside the written range are kept.
+ *
+ * @param memory The memory chunk context.
+ * @param offset Offset inside the buffer to store from.
+ * @param path File to write.
+ * @param file_offset Offset inside the file to write to.
+ * @param size Bytes to write, 0 for the rest of the buffer.
+ * @param io_flags SIMAAI_MEM_IO_* flags.
+ * @param stats Filled with the transfer result, may be NULL.
+ * @return 0 on success, -1 with errno set in case of failure.
+ */
+int simaai_memory_store_file(simaai_memory_t *memory, uint64_t offset, const char *path,
+       uint64_t file_offset, uint64_t size, int io_flags,
+       struct simaai_memory_io_stats *stats);
+
+/**
+ * @brief Enable or disable counting of library lock contention, disabled
+ *        by default. Can also be enabled with SIMAAI_MEM_LOCK_STATS=1.
+ *
+ * @param enable Non zero to count lock acquisitions.
+ * @return None.
+ */
+void simaai_memory_set_lock_stats(int enable);
+
+/**
+ * @brief Get contention counters of the library internal locks
+ *        (allocation registry, pools, dispatcher profile, deferred free).
+ *
+ * @param stats Filled with the counters collected while counting was
+ *        enabled, see simaai_memory_set_lock_stats().
+ * @return None.
+ */
+void simaai_memory_get_lock_stats(struct simaai_memory_lock_stats *stats);
+
+/**
+ * @brief Query capacity and usage of a memory target.
+ *        Total and free bytes are read from the kernel for the generic
+ *        (CMA) target. With SIMAAI_MEM_QUERY_PROBE the largest free block
+ *        is found by a bounded series of allocation attempts, which also
+ *        yields the fragmentation index where the free size is known.
+ *
+ * @param target Memory target to query.
+ * @param query_flags SIMAAI_MEM_QUERY_* flags.
+ * @param info Filled with the target information.
+ * @return 0 on success, -1 in case of failure.
+ */
+int simaai_memory_query_target(int target, int query_flags,
+       struct simaai_memory_target_info *info);
+
+/**
+ * @brief Enumerate the memory chunks currently held by this process.
+ *
+ * @param entries Array to fill, may be NULL to only count.
+ * @param max_entries Size of the entries array.
+ * @return Number of live chunks, which may exceed max_entries.
+ */
+size_t simaai_memory_snapshot(struct simaai_memory_alloc_info *entries, size_t max_entries);
 
 /**
  * @brief copy  the memory chunk from source to destination:
@@ -239,6 +739,202 @@ simaai_memory_t *simaai_memcpy(simaai_memory_t *dst, simaai_memory_t *src);
  */
 simaai_memory_t*  simaai_memcpy_part(simaai_memory_t *dst, uint64_t dst_offset, simaai_memory_t *src, uint64_t src_offset, uint64_t size);
 
+/**
+ * @brief Copy the memory chunk from source to destination with the cheapest
+ *        engine for the target pair and copy size.
+ *        Small copies between mapped buffers are done by the CPU including
+ *        the required cache maintenance, others go through the driver.
+ *        The engine choice is calibrated on first use of a target pair
+ *        unless SIMAAI_MEMCPY_CALIBRATE=0 is set, or loaded from the profile
+ *        named by SIMAAI_MEMCPY_PROFILE. Copies made by other threads
+ *        while a target pair is calibrated use the default choice.
+ *
+ * @param dst The context of the destination memory chunk.
+ * @param dst_offset Memory chunk offset inside the destination buffer.
+ * @param src The context of the source memory chunk.
+ * @param src_offset Memory chunk offset inside the source buffer.
+ * @param size Memory chunk size to be copied.
+ * @return Destination simaai_memory_t pointer or NULL in case of failure.
+ */
+simaai_memory_t *simaai_memcpy_auto(simaai_memory_t *dst, uint64_t dst_offset,
+       simaai_memory_t *src, uint64_t src_offset, uint64_t size);
+
+/**
+ * @brief Copy the memory chunk from source to destination and keep the CPU
+ *        view of both coherent.
+ *        Cached source data written by the CPU is cleaned before the copy,
+ *        and the cached destination is cleaned and invalidated before and
+ *        invalidated after it, so the CPU reads the copied data. Only the
+ *        copied range is maintained and uncached or unmapped sides are
+ *        skipped. The engine is chosen as by simaai_memcpy_auto().
+ *
+ * @param dst The context of the destination memory chunk.
+ * @param dst_offset Memory chunk offset inside the destination buffer.
+ * @param src The context of the source memory chunk.
+ * @param src_offset Memory chunk offset inside the source buffer.
+ * @param size Memory chunk size to be copied.
+ * @return Destination simaai_memory_t pointer or NULL in case of failure.
+ */
+simaai_memory_t *simaai_memcpy_coherent(simaai_memory_t *dst, uint64_t dst_offset,
+       simaai_memory_t *src, uint64_t src_offset, uint64_t size);
+
+/**
+ * @brief Copy the memory chunk from source to destination in a priority
+ *        class, with the engine chosen as by simaai_memcpy_auto().
+ *        SIMAAI_MEMCPY_PRIO_LOW driver copies are split into chunks of
+ *        SIMAAI_MEMCPY_CHUNK bytes (1M by default) and pause between chunks
+ *        while copies of a higher class are in progress. Default priority
+ *        copies are submitted whole unless a high priority copy is in
+ *        progress. Overlapping copies are always submitted whole.
+ *
+ * @param dst The context of the destination memory chunk.
+ * @param dst_offset Memory chunk offset inside the destination buffer.
+ * @param src The context of the source memory chunk.
+ * @param src_offset Memory chunk offset inside the source buffer.
+ * @param size Memory chunk size to be copied.
+ * @param prio SIMAAI_MEMCPY_PRIO_* class of the copy.
+ * @return Destination simaai_memory_t pointer or NULL in case of failure.
+ */
+simaai_memory_t *simaai_memcpy_prio(simaai_memory_t *dst, uint64_t dst_offset,
+       simaai_memory_t *src, uint64_t src_offset, uint64_t size, int prio);
+
+/**
+ * @brief Set the priority class of all copies made by the calling thread
+ *        without an explicit class, SIMAAI_MEMCPY_PRIO_NORMAL by default.
+ *
+ * @param prio SIMAAI_MEMCPY_PRIO_* class.
+ * @return Previous class or -1 if the class is invalid.
+ */
+int simaai_memcpy_set_thread_priority(int prio);
+
+/**
+ * @brief Get the latency statistics of a priority class. Percentiles are
+ *        accurate to 1/8 of a power of two.
+ *
+ * @param prio SIMAAI_MEMCPY_PRIO_* class.
+ * @param stats Filled with the statistics.
+ * @return 0 on success, -1 if the class is invalid.
+ */
+int simaai_memcpy_get_qos_stats(int prio, struct simaai_memcpy_qos_stats *stats);
+
+/**
+ * @brief Clear the latency statistics of all priority classes.
+ *
+ * @return None.
+ */
+void simaai_memcpy_reset_qos_stats(void);
+
+/*
+ * Progress of a large copy, return non zero to cancel it.
+ */
+typedef int (*simaai_memcpy_progress_t)(uint64_t done, uint64_t total, void *arg);
+
+/**
+ * @brief Copy a large range in parallel.
+ *        The range is split into 4M chunks aligned in the destination and
+ *        copied by SIMAAI_MEMCPY_THREADS threads (4 by default) including
+ *        the caller. Chunks go to the engine simaai_memcpy_auto() would
+ *        pick for a chunk, so several driver copies run at once or the CPUs
+ *        share the copy. Cache maintenance is as for simaai_memcpy_auto(),
+ *        and the copies run in the priority class of the calling thread.
+ *
+ * @param dst The context of the destination memory chunk.
+ * @param dst_offset Memory chunk offset inside the destination buffer.
+ * @param src The context of the source memory chunk.
+ * @param src_offset Memory chunk offset inside the source buffer.
+ * @param size Memory chunk size to be copied, the ranges must not overlap.
+ * @param progress Called after every chunk with the bytes copied so far,
+ *        from one worker at a time, may be NULL. A non zero return value
+ *        cancels the copy.
+ * @param arg Argument passed to progress.
+ * @param stats Filled with the achieved bandwidth, may be NULL.
+ * @return Destination simaai_memory_t pointer or NULL in case of failure,
+ *         with errno ECANCELED if the copy was cancelled.
+ */
+simaai_memory_t *simaai_memcpy_large(simaai_memory_t *dst, uint64_t dst_offset,
+       simaai_memory_t *src, uint64_t src_offset, uint64_t size,
+       simaai_memcpy_progress_t progress, void *arg,
+       struct simaai_memory_io_stats *stats);
+
+/**
+ * @brief Copy a rectangle between two buffers, e.g. an image plane or a crop.
+ *        Bounds are validated once for the whole rectangle and rows that are
+ *        contiguous on both sides are collapsed into a single linear copy.
+ *        Source and destination rectangles must not overlap.
+ *
+ * @param dst The context of the destination memory chunk.
+ * @param dst_offset Offset of the first destination row.
+ * @param dst_pitch Distance in bytes between destination rows.
+ * @param src The context of the source memory chunk.
+ * @param src_offset Offset of the first source row.
+ * @param src_pitch Distance in bytes between source rows.
+ * @param width Bytes to copy per row.
+ * @param height Number of rows.
+ * @return Destination simaai_memory_t pointer or NULL in case of failure.
+ */
+simaai_memory_t *simaai_memcpy_2d(simaai_memory_t *dst, uint64_t dst_offset, uint64_t dst_pitch,
+       simaai_memory_t *src, uint64_t src_offset, uint64_t src_pitch,
+       uint64_t width, uint64_t height);
+
+/**
+ * @brief Copy an N-dimensional strided block between two buffers, e.g. a
+ *        tensor tile. The innermost dimension is contiguous, shape[ndim - 1]
+ *        is its size in bytes. Outer dimension i has shape[i] entries placed
+ *        strides[i] bytes apart. Dimensions that are contiguous on both sides
+ *        are merged before copying.
+ *
+ * @param dst The context of the destination memory chunk.
+ * @param dst_offset Offset of the first destination byte.
+ * @param dst_strides ndim - 1 destination strides in bytes.
+ * @param src The context of the source memory chunk.
+ * @param src_offset Offset of the first source byte.
+ * @param src_strides ndim - 1 source strides in bytes.
+ * @param shape ndim dimension sizes, outermost first.
+ * @param ndim Number of dimensions, up to SIMAAI_MEMCPY_MAX_DIMS.
+ * @return Destination simaai_memory_t pointer or NULL in case of failure.
+ */
+simaai_memory_t *simaai_memcpy_nd(simaai_memory_t *dst, uint64_t dst_offset,
+       const uint64_t *dst_strides, simaai_memory_t *src, uint64_t src_offset,
+       const uint64_t *src_strides, const uint64_t *shape, unsigned int ndim);
+
+/**
+ * @brief Measure the CPU and driver copy cost for a target pair and update
+ *        the dispatcher profile. Allocates temporary buffers on both targets.
+ *
+ * @param src_target Source memory target.
+ * @param src_flags Source memory flags, only SIMAAI_MEM_FLAG_CACHED matters.
+ * @param dst_target Destination memory target.
+ * @param dst_flags Destination memory flags, only SIMAAI_MEM_FLAG_CACHED matters.
+ * @return 0 on success, -1 in case of failure.
+ */
+int simaai_memcpy_calibrate(int src_target, int src_flags, int dst_target, int dst_flags);
+
+/**
+ * @brief Get the engine the dispatcher would use for a copy.
+ *        Does not trigger calibration.
+ *
+ * @return SIMAAI_MEMCPY_ENGINE_DMA or SIMAAI_MEMCPY_ENGINE_CPU.
+ */
+int simaai_memcpy_get_engine(int src_target, int src_flags, int dst_target,
+       int dst_flags, uint64_t size);
+
+/**
+ * @brief Load dispatcher profile entries from a file written by
+ *        simaai_memcpy_save_profile().
+ *
+ * @param path Profile file path.
+ * @return 0 on success, -1 in case of failure.
+ */
+int simaai_memcpy_load_profile(const char *path);
+
+/**
+ * @brief Save the calibrated dispatcher profile entries to a file.
+ *
+ * @param path Profile file path.
+ * @return 0 on success, -1 in case of failure.
+ */
+int simaai_memcpy_save_profile(const char *path);
+
 #ifdef __cplusplus
 }
 #endif /* extern "C" { */
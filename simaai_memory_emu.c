@@ -0,0 +1,378 @@
+//SPDX-License-Identifier: (GPL-2.0+ OR MIT)
+/*
+ * Copyright (c) 2021 Sima ai
+ */
+
+#define _GNU_SOURCE
+
+#include "simaai_memory_emu.h"
+
+#include <errno.h>
+#include <linux/simaai/simaai_memory_ioctl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SIMAAI_EMU_PHYS_BASE	(0x80000000ull)
+#define SIMAAI_EMU_BUS_OFFSET	(0x0ull)
+#define SIMAAI_EMU_DEFAULT_SIZE	(256ull * 1024 * 1024)
+#define SIMAAI_EMU_PAGE_SIZE	(4096)
+/* Alignment of segments inside one chunk */
+#define SIMAAI_EMU_SEG_ALIGN	(256)
+#define SIMAAI_EMU_MAX_CHANNELS	(16)
+
+/*
+ * Range of emulated memory, either free or allocated as one chunk that
+ * holds one or more segments.
+ */
+struct simaai_emu_chunk {
+	uint64_t start;
+	uint64_t size;
+	uint32_t target;
+	uint32_t num_of_segments;
+	uint64_t seg_offset[MAX_SEGMENTS];
+	uint64_t seg_size[MAX_SEGMENTS];
+	/* Allocation plus attach references per segment */
+	uint32_t seg_refs[MAX_SEGMENTS];
+	struct simaai_emu_chunk *next;
+};
+
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t emu_once = PTHREAD_ONCE_INIT;
+static int emu_fd = -1;
+static char *emu_base;
+static uint64_t emu_size;
+/* Sorted by start address */
+static struct simaai_emu_chunk *emu_free;
+static struct simaai_emu_chunk *emu_used;
+
+/* Copy engines, a copy occupies one for its whole duration */
+static sem_t emu_channels;
+
+/* -1 until SIMAAI_MEM_EMULATE has been looked at */
+static int emu_selected = -1;
+
+int simaai_memory_emu_enabled(void)
+{
+	const char *value;
+	int selected = __atomic_load_n(&emu_selected, __ATOMIC_RELAXED);
+
+	if (selected < 0) {
+		value = getenv("SIMAAI_MEM_EMULATE");
+		selected = value && (strcmp(value, "0") != 0);
+		__atomic_store_n(&emu_selected, selected, __ATOMIC_RELAXED);
+	}
+
+	return selected;
+}
+
+static uint64_t simaai_memory_emu_size(void)
+{
+	const char *value = getenv("SIMAAI_MEM_EMULATE");
+	char *end;
+	uint64_t size = strtoull(value, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		size <<= 10;
+		break;
+	}
+
+	/* A plain "1" only selects the backend */
+	if (size < SIMAAI_EMU_PAGE_SIZE)
+		size = SIMAAI_EMU_DEFAULT_SIZE;
+
+	return size & ~(uint64_t)(SIMAAI_EMU_PAGE_SIZE - 1);
+}
+
+static unsigned int simaai_memory_emu_num_channels(void)
+{
+	const char *value = getenv("SIMAAI_MEM_EMULATE_CHANNELS");
+	long channels;
+
+	if (!value)
+		return 1;
+
+	channels = strtol(value, NULL, 0);
+	if ((channels <= 0) || (channels > SIMAAI_EMU_MAX_CHANNELS))
+		return 1;
+
+	return channels;
+}
+
+static void simaai_memory_emu_init(void)
+{
+	struct simaai_emu_chunk *range;
+	uint64_t size = simaai_memory_emu_size();
+	int memfd;
+
+	if (sem_init(&emu_channels, 0, simaai_memory_emu_num_channels()) < 0)
+		return;
+
+	memfd = memfd_create("simaai-mem-emu", MFD_CLOEXEC);
+	if (memfd < 0)
+		return;
+
+	range = calloc(1, sizeof(*range));
+	if (!range || (ftruncate(memfd, size) < 0))
+		goto err;
+
+	emu_base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (emu_base == MAP_FAILED)
+		goto err;
+
+	range->size = size;
+	emu_free = range;
+	emu_size = size;
+	emu_fd = memfd;
+	return;
+err:
+	emu_base = NULL;
+	free(range);
+	close(memfd);
+}
+
+int simaai_memory_emu_open(void)
+{
+	pthread_once(&emu_once, simaai_memory_emu_init);
+
+	if (emu_fd < 0)
+		errno = ENODEV;
+
+	return emu_fd;
+}
+
+off_t simaai_memory_emu_mmap_offset(uint64_t phys_addr)
+{
+	return phys_addr - SIMAAI_EMU_PHYS_BASE;
+}
+
+static void simaai_memory_emu_insert(struct simaai_emu_chunk **head, struct simaai_emu_chunk *chunk)
+{
+	while (*head && ((*head)->start < chunk->start))
+		head = &(*head)->next;
+
+	chunk->next = *head;
+	*head = chunk;
+}
+
+/* Return a chunk's range to the free list, merging it with its neighbours */
+static void simaai_memory_emu_release(struct simaai_emu_chunk *chunk)
+{
+	struct simaai_emu_chunk *range, *next;
+
+	chunk->num_of_segments = 0;
+	simaai_memory_emu_insert(&emu_free, chunk);
+
+	for (range = emu_free; range && range->next; ) {
+		next = range->next;
+		if (range->start + range->size == next->start) {
+			range->size += next->size;
+			range->next = next->next;
+			free(next);
+		} else {
+			range = next;
+		}
+	}
+}
+
+static int simaai_memory_emu_alloc(struct simaai_alloc_args *args)
+{
+	struct simaai_emu_chunk **link, *range, *chunk;
+	uint64_t size = 0;
+	uint32_t iter;
+
+	if ((args->num_of_segments == 0) || (args->num_of_segments > MAX_SEGMENTS))
+		return -EINVAL;
+
+	for (iter = 0; iter < args->num_of_segments; iter++) {
+		if (args->size[iter] == 0)
+			return -EINVAL;
+		size = (size + SIMAAI_EMU_SEG_ALIGN - 1) & ~(uint64_t)(SIMAAI_EMU_SEG_ALIGN - 1);
+		size += args->size[iter];
+	}
+	size = (size + SIMAAI_EMU_PAGE_SIZE - 1) & ~(uint64_t)(SIMAAI_EMU_PAGE_SIZE - 1);
+
+	/* First fit */
+	for (link = &emu_free; *link; link = &(*link)->next)
+		if ((*link)->size >= size)
+			break;
+	if (!*link)
+		return -ENOMEM;
+	range = *link;
+
+	if (range->size == size) {
+		*link = range->next;
+		chunk = range;
+	} else {
+		chunk = calloc(1, sizeof(*chunk));
+		if (!chunk)
+			return -ENOMEM;
+		chunk->start = range->start;
+		range->start += size;
+		range->size -= size;
+	}
+
+	chunk->size = size;
+	chunk->target = args->target;
+	chunk->num_of_segments = args->num_of_segments;
+
+	size = 0;
+	for (iter = 0; iter < args->num_of_segments; iter++) {
+		size = (size + SIMAAI_EMU_SEG_ALIGN - 1) & ~(uint64_t)(SIMAAI_EMU_SEG_ALIGN - 1);
+		chunk->seg_offset[iter] = size;
+		chunk->seg_size[iter] = args->size[iter];
+		chunk->seg_refs[iter] = 1;
+		size += args->size[iter];
+
+		args->offset[iter] = chunk->seg_offset[iter];
+		args->phys_addr[iter] = SIMAAI_EMU_PHYS_BASE + chunk->start + chunk->seg_offset[iter];
+		args->bus_addr[iter] = args->phys_addr[iter] + SIMAAI_EMU_BUS_OFFSET;
+	}
+
+	simaai_memory_emu_insert(&emu_used, chunk);
+	return 0;
+}
+
+static struct simaai_emu_chunk *simaai_memory_emu_find(uint64_t phys_addr, uint32_t *segment,
+		struct simaai_emu_chunk ***link_out)
+{
+	struct simaai_emu_chunk **link, *chunk;
+	uint64_t pos = phys_addr - SIMAAI_EMU_PHYS_BASE;
+	uint32_t iter;
+
+	for (link = &emu_used; *link; link = &(*link)->next) {
+		chunk = *link;
+		if ((pos < chunk->start) || (pos >= chunk->start + chunk->size))
+			continue;
+
+		for (iter = 0; iter < chunk->num_of_segments; iter++) {
+			if (chunk->start + chunk->seg_offset[iter] == pos) {
+				*segment = iter;
+				if (link_out)
+					*link_out = link;
+				return chunk;
+			}
+		}
+		break;
+	}
+
+	return NULL;
+}
+
+static int simaai_memory_emu_free(struct simaai_free_args *args)
+{
+	struct simaai_emu_chunk **link, *chunk;
+	uint32_t iter, segment, live;
+	int ret = 0;
+
+	if (args->num_of_segments > MAX_SEGMENTS)
+		return -EINVAL;
+
+	for (iter = 0; iter < args->num_of_segments; iter++) {
+		chunk = simaai_memory_emu_find(args->phys_addr[iter], &segment, &link);
+		if (!chunk || !chunk->seg_refs[segment]) {
+			ret = -EINVAL;
+			continue;
+		}
+
+		chunk->seg_refs[segment]--;
+
+		for (live = 0, segment = 0; segment < chunk->num_of_segments; segment++)
+			live += chunk->seg_refs[segment];
+		if (!live) {
+			*link = chunk->next;
+			simaai_memory_emu_release(chunk);
+		}
+	}
+
+	return ret;
+}
+
+static int simaai_memory_emu_info(struct simaai_memory_info *info)
+{
+	struct simaai_emu_chunk *chunk;
+	uint32_t segment;
+
+	chunk = simaai_memory_emu_find(info->phys_addr, &segment, NULL);
+	if (!chunk || !chunk->seg_refs[segment])
+		return -EINVAL;
+
+	/* Attaching takes a reference that the matching free drops */
+	chunk->seg_refs[segment]++;
+
+	info->offset = chunk->seg_offset[segment];
+	info->target = chunk->target;
+	info->size = chunk->seg_size[segment];
+	info->bus_addr = info->phys_addr + SIMAAI_EMU_BUS_OFFSET;
+
+	return 0;
+}
+
+static int simaai_memory_emu_memcpy(struct simaai_memcpy_args *args)
+{
+	uint64_t src = args->src_addr - SIMAAI_EMU_PHYS_BASE;
+	uint64_t dst = args->dst_addr - SIMAAI_EMU_PHYS_BASE;
+
+	if ((args->src_addr < SIMAAI_EMU_PHYS_BASE) || (args->dst_addr < SIMAAI_EMU_PHYS_BASE) ||
+	    (src > emu_size) || (args->size > emu_size - src) ||
+	    (dst > emu_size) || (args->size > emu_size - dst))
+		return -EFAULT;
+
+	/* The copy itself does not need the allocator lock, only a channel */
+	pthread_mutex_unlock(&emu_lock);
+	while ((sem_wait(&emu_channels) < 0) && (errno == EINTR))
+		;
+	memmove(emu_base + dst, emu_base + src, args->size);
+	sem_post(&emu_channels);
+	pthread_mutex_lock(&emu_lock);
+
+	return 0;
+}
+
+int simaai_memory_emu_ioctl(unsigned long request, void *arg)
+{
+	int ret;
+
+	if (!emu_base) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	pthread_mutex_lock(&emu_lock);
+	switch (request) {
+	case SIMAAI_IOC_MEM_ALLOC_COHERENT:
+		ret = simaai_memory_emu_alloc(arg);
+		break;
+	case SIMAAI_IOC_MEM_FREE:
+		ret = simaai_memory_emu_free(arg);
+		break;
+	case SIMAAI_IOC_MEM_INFO:
+		ret = simaai_memory_emu_info(arg);
+		break;
+	case SIMAAI_IOC_MEMCPY:
+		ret = simaai_memory_emu_memcpy(arg);
+		break;
+	default:
+		ret = -ENOTTY;
+		break;
+	}
+	pthread_mutex_unlock(&emu_lock);
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return 0;
+}
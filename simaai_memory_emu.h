@@ -0,0 +1,51 @@
+//SPDX-License-Identifier: (GPL-2.0+ OR MIT)
+/*
+ * Copyright (c) 2021 Sima ai
+ */
+
+#ifndef _SIMAAI_MEMORY_EMU_H_
+#define _SIMAAI_MEMORY_EMU_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Emulated SiMa.ai memory driver backed by a memfd, used instead of
+ * /dev/simaai-mem when SIMAAI_MEM_EMULATE is set. Lets the library and its
+ * stress tests run on hosts without the hardware. Only built into the
+ * library with make EMULATE=1.
+ */
+
+/**
+ * @brief Check whether the emulated backend is selected.
+ *
+ * @return Non zero if SIMAAI_MEM_EMULATE is set.
+ */
+int simaai_memory_emu_enabled(void);
+
+/**
+ * @brief Open the emulated device, creating its memory on first use.
+ *        SIMAAI_MEM_EMULATE may hold the memory size, e.g. "512M", and
+ *        SIMAAI_MEM_EMULATE_CHANNELS the number of copy engines, 1 by
+ *        default, that SIMAAI_IOC_MEMCPY requests share.
+ *
+ * @return File descriptor to map emulated memory from, or -1.
+ */
+int simaai_memory_emu_open(void);
+
+/**
+ * @brief Handle a SIMAAI_IOC_* request like the driver would.
+ *
+ * @return 0 on success, -1 with errno set in case of failure.
+ */
+int simaai_memory_emu_ioctl(unsigned long request, void *arg);
+
+/**
+ * @brief Translate an emulated physical address into a file offset to
+ *        map it from.
+ *
+ * @return File offset of the physical address.
+ */
+off_t simaai_memory_emu_mmap_offset(uint64_t phys_addr);
+
+#endif /* _SIMAAI_MEMORY_EMU_H_ */
@@ -0,0 +1,103 @@
+//SPDX-License-Identifier: (GPL-2.0+ OR MIT)
+/*
+ * Copyright (c) 2021 Sima ai
+ */
+
+#ifndef _SIMAAI_MEMORY_INLINE_H_
+#define _SIMAAI_MEMORY_INLINE_H_
+
+#include "simaai_memory.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+ * Opt-in inline accessors.
+ *
+ * The leading members of the memory chunk context are kept stable within
+ * an ABI version, so hot loops can read them directly instead of calling
+ * into the library. Applications built against this header should check
+ * simaai_memory_inline_compatible() once at startup, the library asserts
+ * the layout at build time.
+ */
+#define SIMAAI_MEMORY_HEAD_ABI	(1)
+
+/*
+ * Stable head of struct simaai_memory_t, ABI version 1.
+ */
+struct simaai_memory_head {
+	/* Virtual address of memory chunk, NULL when not mapped */
+	void *vaddr;
+	/* Size of memory chunk */
+	uint64_t size;
+	/* Physical address of the memory chunk */
+	uint64_t phys_addr;
+	/* Bus address of the memory chunk */
+	uint64_t bus_addr;
+	/* Target allocation hardware */
+	uint64_t target;
+};
+
+/**
+ * @brief Get the memory chunk head ABI version implemented by the library.
+ *
+ * @return SIMAAI_MEMORY_HEAD_ABI the library was built with.
+ */
+int simaai_memory_get_head_abi(void);
+
+/**
+ * @brief Check that the inline accessors match the loaded library.
+ *
+ * @return Non zero if the inline accessors can be used.
+ */
+static inline int simaai_memory_inline_compatible(void)
+{
+	return simaai_memory_get_head_abi() == SIMAAI_MEMORY_HEAD_ABI;
+}
+
+/**
+ * @brief Inline simaai_memory_get_virt(), without argument checks.
+ */
+static inline void *simaai_memory_get_virt_inline(const simaai_memory_t *memory)
+{
+	return ((const struct simaai_memory_head *)memory)->vaddr;
+}
+
+/**
+ * @brief Inline simaai_memory_get_phys(), without argument checks.
+ */
+static inline uint64_t simaai_memory_get_phys_inline(const simaai_memory_t *memory)
+{
+	return ((const struct simaai_memory_head *)memory)->phys_addr;
+}
+
+/**
+ * @brief Inline simaai_memory_get_bus(), without argument checks.
+ */
+static inline uint64_t simaai_memory_get_bus_inline(const simaai_memory_t *memory)
+{
+	return ((const struct simaai_memory_head *)memory)->bus_addr;
+}
+
+/**
+ * @brief Inline simaai_memory_get_size(), without argument checks.
+ */
+static inline size_t simaai_memory_get_size_inline(const simaai_memory_t *memory)
+{
+	return ((const struct simaai_memory_head *)memory)->size;
+}
+
+/**
+ * @brief Inline simaai_memory_get_target(), without argument checks.
+ */
+static inline uint32_t simaai_memory_get_target_inline(const simaai_memory_t *memory)
+{
+	return ((const struct simaai_memory_head *)memory)->target;
+}
+
+#ifdef __cplusplus
+}
+#endif /* extern "C" { */
+#endif /* _SIMAAI_MEMORY_INLINE_H_ */
@@ -0,0 +1,1133 @@
+//SPDX-License-Identifier: (GPL-2.0+ OR MIT)
+/*
+ * Copyright (c) 2021 Sima ai
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simaai_memory.h"
+
+#define MAX_THREADS	256
+#define MAX_SLOTS	64
+#define MAX_SEGS	5
+#define RANGE_BUFS	3
+#define ARENA_BUFS	8
+/* Large copies span two or three 4M chunks, a few at a time */
+#define LARGE_MIN	(4 * 1024 * 1024 + 1)
+#define LARGE_MAX	(8 * 1024 * 1024)
+#define LARGE_ACTIVE	2
+#define NUM_BUCKETS	48
+
+enum op {
+	OP_ALLOC,
+	OP_SEGMENTS,
+	OP_ATTACH,
+	OP_MAP,
+	OP_CACHE,
+	OP_RANGES,
+	OP_MEMCPY,
+	OP_SLICE,
+	OP_ARENA,
+	OP_LARGE,
+	OP_FREE,
+	NUM_OPS
+};
+
+static const char *const op_names[NUM_OPS] = {
+	"alloc", "segments", "attach", "map", "cache", "ranges", "memcpy", "slice", "arena", "large", "free",
+};
+
+static const char *const prio_names[] = { "high", "normal", "low" };
+
+/* Relative weight of each operation in the random mix */
+static const unsigned int op_weights[NUM_OPS] = { 20, 5, 5, 10, 15, 5, 25, 5, 5, 2, 20 };
+
+struct args {
+	uint64_t seed;
+	long int num_threads;
+	long int duration;
+	long int iterations;
+	long int max_size;
+	long int slots;
+	long int report;
+	unsigned int targets;
+	int cached;
+	int emulate;
+};
+
+struct op_stats {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	/* Latency histogram, bucket n counts [2^n, 2^(n+1)) ns */
+	uint64_t buckets[NUM_BUCKETS];
+};
+
+/*
+ * A buffer owned by one worker. Every byte holds pattern(id, offset)
+ * unless an operation is in the middle of changing it.
+ */
+struct slot {
+	simaai_memory_t *memory;
+	/* Segment group the buffer belongs to, or NULL */
+	simaai_memory_t **group;
+	unsigned int num_group;
+	uint64_t id;
+	uint64_t requested;
+	int target;
+	int flags;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int index;
+	uint64_t rng;
+	uint64_t next_id;
+	struct slot slots[MAX_SLOTS];
+	struct op_stats stats[NUM_OPS];
+	uint64_t integrity_errors;
+	uint64_t invariant_errors;
+	const struct args *args;
+};
+
+static volatile int stop;
+static int large_active;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* xorshift64*, reproducible per worker from the run seed */
+static uint64_t rng_next(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1Dull;
+}
+
+static uint64_t rng_range(uint64_t *state, uint64_t limit)
+{
+	return limit ? rng_next(state) % limit : 0;
+}
+
+static uint8_t pattern(uint64_t id, uint64_t offset)
+{
+	uint64_t value = (id * 0x9E3779B97F4A7C15ull) ^ (offset >> 3) * 0xBF58476D1CE4E5B9ull;
+
+	return value >> ((offset & 7) * 8);
+}
+
+static void fill_pattern(uint8_t *vaddr, uint64_t id, uint64_t offset, uint64_t size)
+{
+	uint64_t iter;
+
+	for (iter = 0; iter < size; iter++)
+		vaddr[iter] = pattern(id, offset + iter);
+}
+
+/* Return the first mismatching offset or size if the range is intact */
+static uint64_t check_pattern(const uint8_t *vaddr, uint64_t id, uint64_t offset, uint64_t size)
+{
+	uint64_t iter;
+
+	for (iter = 0; iter < size; iter++)
+		if (vaddr[iter] != pattern(id, offset + iter))
+			return iter;
+
+	return size;
+}
+
+static int parse_args(const int argc, char *const argv[], struct args *args)
+{
+	const char *filename = argv[0];
+	struct option long_options[] = {
+		{ "help",     no_argument,       NULL, 'h' },
+		{ "seed",     required_argument, NULL, 'S' },
+		{ "threads",  required_argument, NULL, 'p' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "iteration", required_argument, NULL, 'i' },
+		{ "size",     required_argument, NULL, 's' },
+		{ "slots",    required_argument, NULL, 'n' },
+		{ "targets",  required_argument, NULL, 't' },
+		{ "report",   required_argument, NULL, 'r' },
+		{ "cached",   no_argument,       NULL, 'c' },
+		{ "emulate",  no_argument,       NULL, 'e' },
+		{ 0,          0,                 0,     0  }
+	};
+	const char usage[] =
+		"Usage: %s [OPTION]\n"
+		"Randomized concurrent stress test of the SiMa.ai memory library.\n"
+		"\n"
+		"  -h, --help           display this help and exit\n"
+		"  -S, --seed=SEED      random seed, the same seed replays the same mix per thread\n"
+		"  -p, --threads=N      number of worker threads (default 4)\n"
+		"  -d, --duration=SEC   run for SEC seconds (default 10)\n"
+		"  -i, --iteration=N    stop each thread after N operations instead\n"
+		"  -s, --size=SIZE      maximum buffer size in bytes (default 1048576)\n"
+		"  -n, --slots=N        live buffers per thread (default 16)\n"
+		"  -t, --targets=MASK   bit mask of targets to allocate from (default 1, CMA)\n"
+		"  -r, --report=SEC     print intermediate results every SEC seconds\n"
+		"  -c, --cached         also allocate cached buffers\n"
+		"  -e, --emulate        use the emulated driver backend, needs a library\n"
+		"                       built with make EMULATE=1\n";
+	int option_index;
+	int c;
+
+	while (1) {
+		option_index = 0;
+		c = getopt_long(argc, argv, "hS:p:d:i:s:n:t:r:ce", long_options, &option_index);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			fprintf(stderr, usage, basename(filename));
+			return -1;
+		case 'S':
+			args->seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			args->num_threads = strtol(optarg, NULL, 10);
+			if ((args->num_threads <= 0) || (args->num_threads > MAX_THREADS)) {
+				fprintf(stderr, "Invalid number of threads\n");
+				return -1;
+			}
+			break;
+		case 'd':
+			args->duration = strtol(optarg, NULL, 10);
+			if (args->duration < 0) {
+				fprintf(stderr, "Invalid duration\n");
+				return -1;
+			}
+			break;
+		case 'i':
+			args->iterations = strtol(optarg, NULL, 10);
+			if (args->iterations < 0) {
+				fprintf(stderr, "Invalid number of iterations\n");
+				return -1;
+			}
+			break;
+		case 's':
+			args->max_size = strtol(optarg, NULL, 10);
+			if (args->max_size <= 0) {
+				fprintf(stderr, "Invalid size value\n");
+				return -1;
+			}
+			break;
+		case 'n':
+			args->slots = strtol(optarg, NULL, 10);
+			if ((args->slots < MAX_SEGS) || (args->slots > MAX_SLOTS)) {
+				fprintf(stderr, "Invalid number of slots\n");
+				return -1;
+			}
+			break;
+		case 't':
+			args->targets = strtoul(optarg, NULL, 0);
+			if (!args->targets || (args->targets >> (SIMAAI_MEM_TARGET_DMS3 + 1))) {
+				fprintf(stderr, "Invalid target mask\n");
+				return -1;
+			}
+			break;
+		case 'r':
+			args->report = strtol(optarg, NULL, 10);
+			if (args->report < 0) {
+				fprintf(stderr, "Invalid report interval\n");
+				return -1;
+			}
+			break;
+		case 'c':
+			args->cached = 1;
+			break;
+		case 'e':
+			args->emulate = 1;
+			break;
+		default:
+			fprintf(stderr, usage, basename(filename));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void record(struct worker *worker, enum op op, uint64_t start, int ok)
+{
+	struct op_stats *stats = &worker->stats[op];
+	uint64_t elapsed = now_ns() - start;
+	unsigned int bucket = 63 - __builtin_clzll(elapsed | 1);
+
+	if (bucket >= NUM_BUCKETS)
+		bucket = NUM_BUCKETS - 1;
+
+	stats->count++;
+	stats->total_ns += elapsed;
+	if (elapsed > stats->max_ns)
+		stats->max_ns = elapsed;
+	stats->buckets[bucket]++;
+	if (!ok)
+		stats->errors++;
+}
+
+static void invariant_failed(struct worker *worker, const char *what, const struct slot *slot)
+{
+	worker->invariant_errors++;
+	fprintf(stderr, "thread %u: invariant violated: %s (id %llu, phys 0x%llx)\n",
+		worker->index, what, (unsigned long long)slot->id,
+		(unsigned long long)simaai_memory_get_phys(slot->memory));
+}
+
+static void integrity_failed(struct worker *worker, const char *what, const struct slot *slot,
+		uint64_t offset)
+{
+	worker->integrity_errors++;
+	fprintf(stderr, "thread %u: data mismatch after %s (id %llu, offset %llu)\n",
+		worker->index, what, (unsigned long long)slot->id, (unsigned long long)offset);
+}
+
+static int pick_target(struct worker *worker)
+{
+	int target;
+
+	do {
+		target = rng_range(&worker->rng, SIMAAI_MEM_TARGET_DMS3 + 1);
+	} while (!(worker->args->targets & (1u << target)));
+
+	return target;
+}
+
+static int pick_flags(struct worker *worker)
+{
+	if (worker->args->cached && (rng_range(&worker->rng, 2) == 0))
+		return SIMAAI_MEM_FLAG_CACHED;
+
+	return SIMAAI_MEM_FLAG_DEFAULT;
+}
+
+static uint64_t pick_size(struct worker *worker)
+{
+	/* Log-uniform, so small and large buffers are both common */
+	unsigned int shift = rng_range(&worker->rng, 64 - __builtin_clzll(worker->args->max_size));
+	uint64_t size = 1 + rng_range(&worker->rng, 1ull << shift);
+
+	return (size > (uint64_t)worker->args->max_size) ? worker->args->max_size : size;
+}
+
+static struct slot *pick_slot(struct worker *worker, int used)
+{
+	unsigned int start = rng_range(&worker->rng, worker->args->slots);
+	unsigned int iter, index;
+
+	for (iter = 0; iter < worker->args->slots; iter++) {
+		index = (start + iter) % worker->args->slots;
+		if (!!worker->slots[index].memory == used)
+			return &worker->slots[index];
+	}
+
+	return NULL;
+}
+
+static int slot_is_cached(const struct slot *slot)
+{
+	return slot->flags & SIMAAI_MEM_FLAG_CACHED;
+}
+
+/* Fill a freshly obtained buffer with its pattern and check the handle */
+static int slot_setup(struct worker *worker, struct slot *slot)
+{
+	uint8_t *vaddr;
+
+	slot->id = ((uint64_t)worker->index << 48) | worker->next_id++;
+
+	if (simaai_memory_get_size(slot->memory) < slot->requested)
+		invariant_failed(worker, "size smaller than requested", slot);
+	if (simaai_memory_get_target(slot->memory) != (uint32_t)slot->target)
+		invariant_failed(worker, "target differs from requested", slot);
+	if (!simaai_memory_get_phys(slot->memory))
+		invariant_failed(worker, "no physical address", slot);
+	if (simaai_memory_get_virt(slot->memory))
+		invariant_failed(worker, "new buffer already mapped", slot);
+
+	vaddr = simaai_memory_map(slot->memory);
+	if (!vaddr)
+		return -1;
+	if (simaai_memory_get_virt(slot->memory) != vaddr)
+		invariant_failed(worker, "virtual address differs from mapping", slot);
+
+	fill_pattern(vaddr, slot->id, 0, slot->requested);
+	if (slot_is_cached(slot))
+		simaai_memory_flush_cache(slot->memory);
+
+	return 0;
+}
+
+static void release_slot(struct worker *worker, struct slot *slot);
+
+static int op_alloc(struct worker *worker)
+{
+	struct slot *slot = pick_slot(worker, 0);
+
+	if (!slot)
+		return 1;
+
+	slot->requested = pick_size(worker);
+	slot->target = pick_target(worker);
+	slot->flags = pick_flags(worker);
+	slot->group = NULL;
+	slot->memory = simaai_memory_alloc_flags(slot->requested, slot->target, slot->flags);
+	if (!slot->memory)
+		return 0;
+
+	if (slot_setup(worker, slot) < 0) {
+		simaai_memory_free(slot->memory);
+		slot->memory = NULL;
+		return 0;
+	}
+
+	return 1;
+}
+
+static int op_segments(struct worker *worker)
+{
+	struct slot *slots[MAX_SEGS];
+	simaai_memory_t **group;
+	uint32_t sizes[MAX_SEGS];
+	unsigned int num = 1 + rng_range(&worker->rng, MAX_SEGS);
+	unsigned int iter, found = 0;
+	int target = pick_target(worker);
+	int flags = pick_flags(worker);
+
+	for (iter = 0; iter < worker->args->slots && found < num; iter++)
+		if (!worker->slots[iter].memory)
+			slots[found++] = &worker->slots[iter];
+	if (found < num)
+		return 1;
+
+	for (iter = 0; iter < num; iter++)
+		sizes[iter] = 1 + rng_range(&worker->rng, worker->args->max_size / num);
+
+	if (rng_range(&worker->rng, 2))
+		flags |= SIMAAI_MEM_FLAG_SHARED_MAP;
+
+	group = simaai_memory_alloc_segments_flags(sizes, num, target, flags);
+	if (!group)
+		return 0;
+
+	for (iter = 0; iter < num; iter++) {
+		slots[iter]->memory = group[iter];
+		slots[iter]->group = group;
+		slots[iter]->num_group = num;
+		slots[iter]->requested = sizes[iter];
+		slots[iter]->target = target;
+		slots[iter]->flags = flags;
+	}
+
+	/* Segments are freed together, which clears every slot of the group */
+	for (iter = 0; iter < num; iter++) {
+		if (slot_setup(worker, slots[iter]) < 0) {
+			release_slot(worker, slots[0]);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int op_attach(struct worker *worker)
+{
+	struct slot *slot = pick_slot(worker, 1);
+	simaai_memory_t *attached;
+	uint8_t *vaddr;
+	uint64_t mismatch, len;
+
+	if (!slot)
+		return 1;
+
+	attached = simaai_memory_attach(simaai_memory_get_phys(slot->memory));
+	if (!attached)
+		return 0;
+
+	/* Pooled chunks report the requested size, attach sees the whole chunk */
+	if ((simaai_memory_get_phys(attached) != simaai_memory_get_phys(slot->memory)) ||
+	    (simaai_memory_get_size(attached) < simaai_memory_get_size(slot->memory)))
+		invariant_failed(worker, "attached handle differs from owner", slot);
+
+	vaddr = simaai_memory_map(attached);
+	if (vaddr) {
+		len = slot->requested;
+		if (slot_is_cached(slot))
+			simaai_memory_invalidate_cache(attached);
+		mismatch = check_pattern(vaddr, slot->id, 0, len);
+		if (mismatch != len)
+			integrity_failed(worker, "attach", slot, mismatch);
+		simaai_memory_unmap(attached);
+	}
+
+	simaai_memory_free(attached);
+	return vaddr != NULL;
+}
+
+static int op_map(struct worker *worker)
+{
+	struct slot *slot = pick_slot(worker, 1);
+	uint8_t *vaddr;
+	uint64_t mismatch;
+
+	if (!slot)
+		return 1;
+
+	simaai_memory_unmap(slot->memory);
+	if (simaai_memory_get_virt(slot->memory))
+		invariant_failed(worker, "unmapped buffer still has an address", slot);
+
+	/* Other ops expect every buffer in use to be mapped */
+	vaddr = simaai_memory_map(slot->memory);
+	if (!vaddr) {
+		release_slot(worker, slot);
+		return 0;
+	}
+
+	if (slot_is_cached(slot))
+		simaai_memory_invalidate_cache(slot->memory);
+	mismatch = check_pattern(vaddr, slot->id, 0, slot->requested);
+	if (mismatch != slot->requested)
+		integrity_failed(worker, "remap", slot, mismatch);
+
+	return 1;
+}
+
+static int op_cache(struct worker *worker)
+{
+	struct slot *slot = pick_slot(worker, 1);
+	uint64_t offset, size;
+
+	if (!slot)
+		return 1;
+
+	offset = rng_range(&worker->rng, slot->requested);
+	size = 1 + rng_range(&worker->rng, slot->requested - offset);
+
+	/* Contents are always clean, so both operations must preserve them */
+	if (rng_range(&worker->rng, 2))
+		simaai_memory_flush_cache_part64(slot->memory, offset, size);
+	else
+		simaai_memory_invalidate_cache_part64(slot->memory, offset, size);
+
+	if (check_pattern((uint8_t *)simaai_memory_get_virt(slot->memory) + offset,
+			  slot->id, offset, size) != size)
+		integrity_failed(worker, "cache maintenance", slot, offset);
+
+	return 1;
+}
+
+/*
+ * Rewrite a few buffers through the CPU, write them back with one batch of
+ * overlapping and adjacent ranges, and read them back with a driver copy.
+ */
+static int op_ranges(struct worker *worker)
+{
+	struct simaai_memory_cache_range ranges[RANGE_BUFS * 3];
+	struct slot *slots[RANGE_BUFS];
+	simaai_memory_t *check;
+	uint8_t *vaddr;
+	uint64_t split, offset, mismatch;
+	unsigned int num = 0, count = 0, iter, prev;
+	int ok = 1;
+
+	for (iter = 0; iter < RANGE_BUFS; iter++) {
+		slots[num] = pick_slot(worker, 1);
+		for (prev = 0; slots[num] && (prev < num); prev++)
+			if (slots[prev] == slots[num])
+				break;
+		if (slots[num] && (prev == num))
+			num++;
+	}
+	if (!num)
+		return 1;
+
+	for (iter = 0; iter < num; iter++) {
+		slots[iter]->id = ((uint64_t)worker->index << 48) | worker->next_id++;
+		fill_pattern(simaai_memory_get_virt(slots[iter]->memory), slots[iter]->id, 0,
+			     slots[iter]->requested);
+
+		/* [0, split) and [split, end) are adjacent, the third one overlaps them */
+		split = 1 + rng_range(&worker->rng, slots[iter]->requested);
+		offset = rng_range(&worker->rng, slots[iter]->requested);
+		ranges[count++] = (struct simaai_memory_cache_range){
+			slots[iter]->memory, 0, split, rng_range(&worker->rng, 2) };
+		ranges[count++] = (struct simaai_memory_cache_range){
+			slots[iter]->memory, split, 0, rng_range(&worker->rng, 2) };
+		ranges[count++] = (struct simaai_memory_cache_range){
+			slots[iter]->memory, offset, 1 + rng_range(&worker->rng, slots[iter]->requested - offset),
+			rng_range(&worker->rng, 2) };
+	}
+
+	simaai_memory_cache_ranges(ranges, count);
+
+	for (iter = 0; iter < num; iter++) {
+		if (check_pattern(simaai_memory_get_virt(slots[iter]->memory), slots[iter]->id, 0,
+				  slots[iter]->requested) != slots[iter]->requested)
+			integrity_failed(worker, "cache ranges", slots[iter], 0);
+
+		/* An uncached copy only sees what was written back */
+		check = simaai_memory_alloc(slots[iter]->requested, slots[iter]->target);
+		if (!check) {
+			ok = 0;
+			continue;
+		}
+		vaddr = simaai_memory_map(check);
+		if (vaddr && (simaai_memcpy_part(check, 0, slots[iter]->memory, 0,
+						 slots[iter]->requested) == check)) {
+			mismatch = check_pattern(vaddr, slots[iter]->id, 0, slots[iter]->requested);
+			if (mismatch != slots[iter]->requested)
+				integrity_failed(worker, "cache ranges write back", slots[iter], mismatch);
+		} else {
+			ok = 0;
+		}
+		simaai_memory_free(check);
+	}
+
+	return ok;
+}
+
+static int op_memcpy(struct worker *worker)
+{
+	struct slot *src = pick_slot(worker, 1);
+	struct slot *dst = pick_slot(worker, 1);
+	uint8_t *dst_vaddr, *src_vaddr;
+	uint64_t src_offset, dst_offset, size, mismatch;
+	simaai_memory_t *ret;
+	int coherent;
+
+	if (!src || !dst || (src == dst))
+		return 1;
+
+	src_offset = rng_range(&worker->rng, src->requested);
+	dst_offset = rng_range(&worker->rng, dst->requested);
+	size = 1 + rng_range(&worker->rng, src->requested - src_offset);
+	if (size > dst->requested - dst_offset)
+		size = dst->requested - dst_offset;
+
+	coherent = 0;
+	switch (rng_range(&worker->rng, 3)) {
+	case 0:
+		ret = simaai_memcpy_part(dst->memory, dst_offset, src->memory, src_offset, size);
+		break;
+	case 1:
+		ret = simaai_memcpy_auto(dst->memory, dst_offset, src->memory, src_offset, size);
+		break;
+	default:
+		ret = simaai_memcpy_coherent(dst->memory, dst_offset, src->memory, src_offset, size);
+		coherent = 1;
+		break;
+	}
+
+	if (ret != dst->memory)
+		return 0;
+
+	dst_vaddr = simaai_memory_get_virt(dst->memory);
+	src_vaddr = simaai_memory_get_virt(src->memory);
+
+	if (slot_is_cached(dst) && !coherent)
+		simaai_memory_invalidate_cache_part64(dst->memory, dst_offset, size);
+	mismatch = check_pattern(dst_vaddr + dst_offset, src->id, src_offset, size);
+	if (mismatch != size)
+		integrity_failed(worker, "memcpy", dst, dst_offset + mismatch);
+	if (check_pattern(src_vaddr + src_offset, src->id, src_offset, size) != size)
+		integrity_failed(worker, "memcpy source", src, src_offset);
+
+	/* Restore the destination pattern */
+	fill_pattern(dst_vaddr + dst_offset, dst->id, dst_offset, size);
+	if (slot_is_cached(dst))
+		simaai_memory_flush_cache_part64(dst->memory, dst_offset, size);
+
+	return 1;
+}
+
+static int op_slice(struct worker *worker)
+{
+	struct slot *slot = pick_slot(worker, 1);
+	simaai_memory_t *slice;
+	uint8_t *vaddr;
+	uint64_t offset, size, mismatch;
+
+	if (!slot)
+		return 1;
+
+	offset = rng_range(&worker->rng, slot->requested);
+	size = 1 + rng_range(&worker->rng, slot->requested - offset);
+
+	slice = simaai_memory_slice(slot->memory, offset, size);
+	if (!slice)
+		return 0;
+
+	if ((simaai_memory_get_phys(slice) != simaai_memory_get_phys(slot->memory) + offset) ||
+	    (simaai_memory_get_size(slice) != size))
+		invariant_failed(worker, "slice handle differs from parent", slot);
+
+	/* The slice keeps a freed parent alive, segments are freed together */
+	if (!slot->group && !rng_range(&worker->rng, 4))
+		release_slot(worker, slot);
+
+	vaddr = simaai_memory_map(slice);
+	if (vaddr) {
+		if (slot_is_cached(slot))
+			simaai_memory_invalidate_cache(slice);
+		mismatch = check_pattern(vaddr, slot->id, offset, size);
+		if (mismatch != size)
+			integrity_failed(worker, "slice", slot, offset + mismatch);
+	}
+
+	simaai_memory_free(slice);
+	return vaddr != NULL;
+}
+
+/* Allocate arena buffers first to last - 1, check their zero fill and fill their pattern */
+static unsigned int arena_fill(struct worker *worker, simaai_memory_arena_t *arena, int flags,
+		struct slot *bufs, unsigned int first, unsigned int last)
+{
+	static const uint64_t aligns[] = { 0, 64, 4096 };
+	uint64_t align, mismatch;
+	unsigned int iter;
+	uint8_t *vaddr;
+
+	for (iter = first; iter < last; iter++) {
+		bufs[iter].requested = 1 + rng_range(&worker->rng, worker->args->max_size / ARENA_BUFS);
+		align = aligns[rng_range(&worker->rng, 3)];
+		bufs[iter].memory = simaai_memory_arena_alloc(arena, bufs[iter].requested, align);
+		if (!bufs[iter].memory)
+			break;
+
+		bufs[iter].id = ((uint64_t)worker->index << 48) | worker->next_id++;
+		if (align && (simaai_memory_get_phys(bufs[iter].memory) & (align - 1)))
+			invariant_failed(worker, "arena buffer misaligned", &bufs[iter]);
+
+		vaddr = simaai_memory_get_virt(bufs[iter].memory);
+		if (flags & SIMAAI_MEM_FLAG_ZERO) {
+			if (flags & SIMAAI_MEM_FLAG_CACHED)
+				simaai_memory_invalidate_cache(bufs[iter].memory);
+			for (mismatch = 0; mismatch < bufs[iter].requested; mismatch++)
+				if (vaddr[mismatch])
+					break;
+			if (mismatch != bufs[iter].requested)
+				integrity_failed(worker, "arena zero fill", &bufs[iter], mismatch);
+		}
+		fill_pattern(vaddr, bufs[iter].id, 0, bufs[iter].requested);
+	}
+
+	return iter;
+}
+
+/*
+ * Run one arena through allocation, a reset refused while a released
+ * buffer has a slice, a reset to a mark, reuse of the released space with
+ * ZERO checks on the recycled memory, and destruction.
+ */
+static int op_arena(struct worker *worker)
+{
+	struct slot bufs[ARENA_BUFS];
+	simaai_memory_arena_t *arena;
+	simaai_memory_t *slice;
+	uint64_t mark, used, mismatch;
+	unsigned int num, iter;
+	int flags = pick_flags(worker);
+	int ok = 1;
+
+	if (rng_range(&worker->rng, 2))
+		flags |= SIMAAI_MEM_FLAG_ZERO;
+
+	/* Room for the worst case alignment padding of every buffer */
+	arena = simaai_memory_arena_create(worker->args->max_size + ARENA_BUFS * 4096,
+					   pick_target(worker), flags);
+	if (!arena)
+		return 0;
+
+	num = arena_fill(worker, arena, flags, bufs, 0, rng_range(&worker->rng, ARENA_BUFS));
+	mark = simaai_memory_arena_mark(arena);
+	used = simaai_memory_arena_get_used(arena);
+	num = arena_fill(worker, arena, flags, bufs, num, ARENA_BUFS);
+
+	if (num > mark) {
+		slice = simaai_memory_slice(bufs[mark].memory, 0, bufs[mark].requested);
+		if (slice) {
+			if ((simaai_memory_arena_reset(arena, mark) == 0) || (errno != EBUSY))
+				invariant_failed(worker, "arena reset with a live slice", &bufs[mark]);
+			simaai_memory_free(slice);
+		}
+	}
+
+	if (simaai_memory_arena_reset(arena, mark) < 0) {
+		ok = 0;
+	} else {
+		if (simaai_memory_arena_get_used(arena) != used) {
+			bufs[mark].memory = simaai_memory_arena_get_memory(arena);
+			bufs[mark].id = 0;
+			invariant_failed(worker, "arena usage differs after reset", &bufs[mark]);
+		}
+		num = arena_fill(worker, arena, flags, bufs, mark, ARENA_BUFS);
+	}
+
+	for (iter = 0; iter < num; iter++) {
+		mismatch = check_pattern(simaai_memory_get_virt(bufs[iter].memory), bufs[iter].id, 0,
+					 bufs[iter].requested);
+		if (mismatch != bufs[iter].requested)
+			integrity_failed(worker, "arena", &bufs[iter], mismatch);
+	}
+
+	if (simaai_memory_arena_destroy(arena) < 0)
+		ok = 0;
+
+	return ok;
+}
+
+struct large_progress {
+	uint64_t size;
+	uint64_t done;
+	/* Cancel once this many bytes are done, 0 never */
+	uint64_t cancel_at;
+	int calls;
+	int bad;
+};
+
+static int large_progress(uint64_t done, uint64_t total, void *arg)
+{
+	struct large_progress *progress = arg;
+
+	if ((total != progress->size) || (done <= progress->done) || (done > total))
+		progress->bad = 1;
+	progress->done = done;
+	progress->calls++;
+
+	return progress->cancel_at && (done >= progress->cancel_at);
+}
+
+/*
+ * Copy a range spanning several chunks with simaai_memcpy_large(),
+ * checking the progress reports, and cancel a quarter of the copies
+ * part way through.
+ */
+static int op_large(struct worker *worker)
+{
+	struct large_progress progress = { 0 };
+	struct slot src = { 0 }, dst = { 0 };
+	uint64_t src_offset, dst_offset, size, mismatch;
+	simaai_memory_t *ret;
+	int ok = 0;
+
+	if (__atomic_add_fetch(&large_active, 1, __ATOMIC_ACQ_REL) > LARGE_ACTIVE) {
+		__atomic_sub_fetch(&large_active, 1, __ATOMIC_ACQ_REL);
+		return 1;
+	}
+
+	size = LARGE_MIN + rng_range(&worker->rng, LARGE_MAX - LARGE_MIN);
+	src_offset = rng_range(&worker->rng, 4096);
+	dst_offset = rng_range(&worker->rng, 4096);
+
+	src.requested = src_offset + size;
+	src.target = SIMAAI_MEM_TARGET_GENERIC;
+	src.flags = pick_flags(worker);
+	dst.requested = dst_offset + size;
+	dst.target = SIMAAI_MEM_TARGET_GENERIC;
+	dst.flags = pick_flags(worker);
+
+	src.memory = simaai_memory_alloc_flags(src.requested, src.target, src.flags);
+	dst.memory = simaai_memory_alloc_flags(dst.requested, dst.target, dst.flags);
+	if (!src.memory || !dst.memory || (slot_setup(worker, &src) < 0) ||
+	    (slot_setup(worker, &dst) < 0))
+		goto out;
+
+	progress.size = size;
+	if (!rng_range(&worker->rng, 4))
+		progress.cancel_at = 1;
+
+	ret = simaai_memcpy_large(dst.memory, dst_offset, src.memory, src_offset, size,
+				  large_progress, &progress, NULL);
+
+	if (progress.bad)
+		invariant_failed(worker, "large copy progress out of order", &dst);
+
+	if (progress.cancel_at) {
+		if (ret || (errno != ECANCELED))
+			invariant_failed(worker, "large copy not cancelled", &dst);
+		if (progress.calls != 1)
+			invariant_failed(worker, "large copy progress after cancel", &dst);
+		ok = 1;
+		goto out;
+	}
+
+	if (ret != dst.memory)
+		goto out;
+	if ((progress.done != size) || (progress.calls < 2))
+		invariant_failed(worker, "large copy progress incomplete", &dst);
+
+	if (slot_is_cached(&dst))
+		simaai_memory_invalidate_cache(dst.memory);
+	mismatch = check_pattern((uint8_t *)simaai_memory_get_virt(dst.memory) + dst_offset,
+				 src.id, src_offset, size);
+	if (mismatch != size)
+		integrity_failed(worker, "large copy", &dst, dst_offset + mismatch);
+	ok = 1;
+out:
+	if (src.memory)
+		simaai_memory_free(src.memory);
+	if (dst.memory)
+		simaai_memory_free(dst.memory);
+	__atomic_sub_fetch(&large_active, 1, __ATOMIC_ACQ_REL);
+	return ok;
+}
+
+static void release_slot(struct worker *worker, struct slot *slot)
+{
+	simaai_memory_t **group = slot->group;
+	unsigned int iter;
+
+	if (!group) {
+		simaai_memory_free(slot->memory);
+		slot->memory = NULL;
+		return;
+	}
+
+	/* Segments are freed together */
+	for (iter = 0; iter < worker->args->slots; iter++) {
+		if (worker->slots[iter].group == group) {
+			worker->slots[iter].memory = NULL;
+			worker->slots[iter].group = NULL;
+		}
+	}
+	simaai_memory_free_segments(group, slot->num_group);
+}
+
+static int op_free(struct worker *worker)
+{
+	struct slot *slot = pick_slot(worker, 1);
+	uint64_t mismatch;
+
+	if (!slot)
+		return 1;
+
+	if (slot_is_cached(slot))
+		simaai_memory_invalidate_cache(slot->memory);
+	mismatch = check_pattern(simaai_memory_get_virt(slot->memory), slot->id, 0, slot->requested);
+	if (mismatch != slot->requested)
+		integrity_failed(worker, "lifetime", slot, mismatch);
+
+	release_slot(worker, slot);
+	return 1;
+}
+
+static int (*const op_funcs[NUM_OPS])(struct worker *) = {
+	op_alloc, op_segments, op_attach, op_map, op_cache, op_ranges, op_memcpy, op_slice, op_arena, op_large, op_free,
+};
+
+static enum op pick_op(struct worker *worker)
+{
+	unsigned int total = 0, iter, pick;
+
+	for (iter = 0; iter < NUM_OPS; iter++)
+		total += op_weights[iter];
+
+	pick = rng_range(&worker->rng, total);
+	for (iter = 0; iter < NUM_OPS; iter++) {
+		if (pick < op_weights[iter])
+			break;
+		pick -= op_weights[iter];
+	}
+
+	return iter;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *worker = arg;
+	long int done;
+	uint64_t start;
+	enum op op;
+	unsigned int iter;
+	int ok;
+
+	/* Workers are spread over the memcpy priority classes */
+	simaai_memcpy_set_thread_priority(worker->index % (SIMAAI_MEMCPY_PRIO_LOW + 1));
+
+	for (done = 0; !stop; done++) {
+		if (worker->args->iterations && (done >= worker->args->iterations))
+			break;
+
+		op = pick_op(worker);
+		start = now_ns();
+		ok = op_funcs[op](worker);
+		record(worker, op, start, ok);
+	}
+
+	for (iter = 0; iter < worker->args->slots; iter++)
+		if (worker->slots[iter].memory)
+			release_slot(worker, &worker->slots[iter]);
+
+	return NULL;
+}
+
+static uint64_t percentile(const struct op_stats *stats, double fraction)
+{
+	uint64_t target = stats->count * fraction, seen = 0;
+	unsigned int bucket;
+
+	for (bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+		seen += stats->buckets[bucket];
+		if (seen > target)
+			return 2ull << bucket;
+	}
+
+	return stats->max_ns;
+}
+
+static void report(struct worker *workers, long int num_threads, uint64_t elapsed_ns)
+{
+	struct simaai_memory_lock_stats lock_stats;
+	struct simaai_memcpy_qos_stats qos;
+	int prio;
+	struct op_stats total;
+	uint64_t integrity = 0, invariant = 0, ops = 0;
+	unsigned int op, bucket;
+	long int iter;
+
+	fprintf(stdout, "%-9s %10s %8s %10s %10s %10s %10s %10s\n",
+		"op", "count", "errors", "ops/s", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+
+	for (op = 0; op < NUM_OPS; op++) {
+		memset(&total, 0, sizeof(total));
+		for (iter = 0; iter < num_threads; iter++) {
+			const struct op_stats *stats = &workers[iter].stats[op];
+
+			total.count += stats->count;
+			total.errors += stats->errors;
+			total.total_ns += stats->total_ns;
+			if (stats->max_ns > total.max_ns)
+				total.max_ns = stats->max_ns;
+			for (bucket = 0; bucket < NUM_BUCKETS; bucket++)
+				total.buckets[bucket] += stats->buckets[bucket];
+		}
+		ops += total.count;
+
+		fprintf(stdout, "%-9s %10llu %8llu %10.0f %10.1f %10.1f %10.1f %10.1f\n",
+			op_names[op], (unsigned long long)total.count,
+			(unsigned long long)total.errors,
+			elapsed_ns ? total.count * 1e9 / elapsed_ns : 0.0,
+			total.count ? total.total_ns / 1e3 / total.count : 0.0,
+			percentile(&total, 0.50) / 1e3, percentile(&total, 0.99) / 1e3,
+			total.max_ns / 1e3);
+	}
+
+	for (iter = 0; iter < num_threads; iter++) {
+		integrity += workers[iter].integrity_errors;
+		invariant += workers[iter].invariant_errors;
+	}
+
+	for (prio = SIMAAI_MEMCPY_PRIO_HIGH; prio <= SIMAAI_MEMCPY_PRIO_LOW; prio++) {
+		if ((simaai_memcpy_get_qos_stats(prio, &qos) < 0) || !qos.count)
+			continue;
+		fprintf(stdout, "memcpy %-6s  %llu copies, p50 %.1f us, p99 %.1f us, max %.1f us, %llu preempted\n",
+			prio_names[prio], (unsigned long long)qos.count, qos.p50_ns / 1e3,
+			qos.p99_ns / 1e3, qos.max_ns / 1e3, (unsigned long long)qos.preemptions);
+	}
+
+	simaai_memory_get_lock_stats(&lock_stats);
+	fprintf(stdout, "total %llu ops in %.1f s (%.0f ops/s), integrity errors %llu, invariant errors %llu\n",
+		(unsigned long long)ops, elapsed_ns / 1e9, elapsed_ns ? ops * 1e9 / elapsed_ns : 0.0,
+		(unsigned long long)integrity, (unsigned long long)invariant);
+	fprintf(stdout, "library locks: %llu acquisitions, %llu contended (%.2f%%), %.3f ms waiting\n",
+		(unsigned long long)lock_stats.acquisitions, (unsigned long long)lock_stats.contended,
+		lock_stats.acquisitions ? lock_stats.contended * 100.0 / lock_stats.acquisitions : 0.0,
+		lock_stats.wait_ns / 1e6);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	struct args args = { 0 };
+	struct worker *workers;
+	uint64_t start, next_report, integrity = 0, invariant = 0;
+	long int iter;
+
+	args.seed = time(NULL);
+	args.num_threads = 4;
+	args.duration = 10;
+	args.max_size = 1024 * 1024;
+	args.slots = 16;
+	args.targets = 1u << SIMAAI_MEM_TARGET_GENERIC;
+	if (parse_args(argc, argv, &args) != 0)
+		return EXIT_FAILURE;
+
+	/* Must be set before the first library call opens the device */
+	if (args.emulate)
+		setenv("SIMAAI_MEM_EMULATE", "1", 0);
+
+	simaai_memory_set_lock_stats(1);
+
+	workers = calloc(args.num_threads, sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "Worker allocation failed: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stdout, "seed %llu, %ld threads, %s %ld, max size %ld, targets 0x%x%s%s\n",
+		(unsigned long long)args.seed, args.num_threads,
+		args.iterations ? "iterations" : "seconds",
+		args.iterations ? args.iterations : args.duration, args.max_size, args.targets,
+		args.cached ? ", cached" : "", args.emulate ? ", emulated" : "");
+
+	start = now_ns();
+	for (iter = 0; iter < args.num_threads; iter++) {
+		workers[iter].index = iter;
+		workers[iter].args = &args;
+		workers[iter].rng = (args.seed + 1) * 0x9E3779B97F4A7C15ull + iter * 0xD1B54A32D192ED03ull;
+		if (!workers[iter].rng)
+			workers[iter].rng = 1;
+		if (pthread_create(&workers[iter].thread, NULL, worker_thread, &workers[iter]) != 0) {
+			fprintf(stderr, "Thread creation failed\n");
+			stop = 1;
+			args.num_threads = iter;
+			break;
+		}
+	}
+
+	next_report = start + args.report * 1000000000ull;
+	while (!args.iterations && !stop) {
+		sleep(1);
+		if (now_ns() - start >= args.duration * 1000000000ull)
+			stop = 1;
+		else if (args.report && (now_ns() >= next_report)) {
+			/* Counters are read racily, good enough for progress */
+			report(workers, args.num_threads, now_ns() - start);
+			next_report += args.report * 1000000000ull;
+		}
+	}
+
+	for (iter = 0; iter < args.num_threads; iter++)
+		pthread_join(workers[iter].thread, NULL);
+
+	report(workers, args.num_threads, now_ns() - start);
+
+	for (iter = 0; iter < args.num_threads; iter++) {
+		integrity += workers[iter].integrity_errors;
+		invariant += workers[iter].invariant_errors;
+	}
+	free(workers);
+
+	return (integrity || invariant) ? EXIT_FAILURE : EXIT_SUCCESS;
+}